@@ -0,0 +1,66 @@
+// micro-benchmark of the directory block scanning kernels
+// usage: dir_scan_bench [n_iterations]
+// configure with -DCMAKE_BUILD_TYPE=Release, the numbers are meaningless without optimization
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dir_scan.h"
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// a full directory block: every slot occupied, names of varying length,
+// like a block filled by add_file_to_dir with the unused bytes left as -1
+static void fill_block(struct entry* block) {
+    memset(block, -1, MINIFS_BLOCK_SIZE);
+    for (int i = 0; i < ENTRIES_PER_BLOCK; ++i) {
+        block[i].inode_id = i;
+        snprintf(block[i].filename, FILENAME_LEN, "file_%0*d", 1 + i % 16, i);
+    }
+}
+
+int main(int argc, char** argv) {
+    const int n_iterations = (argc >= 2 ? atoi(argv[1]) : 1000000);
+    struct entry block[ENTRIES_PER_BLOCK];
+    fill_block(block);
+    // the worst case for a lookup: the match is in the last slot
+    const char* name = block[ENTRIES_PER_BLOCK - 1].filename;
+    const int inode_id = block[ENTRIES_PER_BLOCK - 1].inode_id;
+
+    printf("dispatching to: %s\n", dir_scan_kernel_name());
+    printf("%-8s %16s %16s\n", "kernel", "name ns/block", "inode ns/block");
+    for (int k = 0; k < n_dir_scan_variants; ++k) {
+        const struct dir_scan_kernels* kernels = dir_scan_variants + k;
+        if (!kernels->supported()) {
+            printf("%-8s %16s %16s\n", kernels->name, "unsupported", "unsupported");
+            continue;
+        }
+        volatile uint32_t sink = 0;
+
+        double start = now_ns();
+        for (int i = 0; i < n_iterations; ++i) {
+            sink += kernels->match_name(block, name);
+        }
+        double name_ns = (now_ns() - start) / n_iterations;
+
+        start = now_ns();
+        for (int i = 0; i < n_iterations; ++i) {
+            sink += kernels->match_inode(block, inode_id);
+        }
+        double inode_ns = (now_ns() - start) / n_iterations;
+
+        if (kernels->match_name(block, name) != 1u << (ENTRIES_PER_BLOCK - 1)
+                || kernels->match_inode(block, inode_id) != 1u << (ENTRIES_PER_BLOCK - 1)) {
+            printf("%s: wrong result\n", kernels->name);
+            return 1;
+        }
+        printf("%-8s %16.1f %16.1f\n", kernels->name, name_ns, inode_ns);
+    }
+    return 0;
+}
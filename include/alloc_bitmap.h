@@ -0,0 +1,48 @@
+#ifndef ALLOC_BITMAP_H
+#define ALLOC_BITMAP_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// in-memory copy of an on-disk allocation bitmap (a set bit means free), split into allocation groups.
+// allocation and freeing are lock-free: a thread first reserves one unit of the total and of a group's
+// free counter, then claims a bit with a CAS on the group's 64-bit words, and writes the changed byte through.
+// a group is one word, i.e. 64 consecutive blocks or inodes
+#define ALLOC_GROUP_SIZE 64
+
+struct alloc_bitmap {
+    int               n_bits;
+    int               n_groups;
+    int               disk_offset;
+    _Atomic uint64_t* words;
+    _Atomic int*      group_free;
+    _Atomic int       total_free;
+};
+
+// load the bitmap of n_bits bits stored at disk_offset
+void alloc_bitmap_init(struct alloc_bitmap* bitmap, int n_bits, int disk_offset);
+
+// returns -1 if there are no free bits left; starts looking in preferred_group and moves on to the next ones
+int alloc_bitmap_allocate(struct alloc_bitmap* bitmap, int preferred_group);
+
+// claims up to max_len consecutive free bits inside one group, the first of them goes to *first_bit.
+// returns how many it got, 0 if there are no free bits left
+int alloc_bitmap_allocate_run(struct alloc_bitmap* bitmap, int preferred_group, int max_len, int* first_bit);
+
+// returns -1 if the bit wasn't allocated
+int alloc_bitmap_free(struct alloc_bitmap* bitmap, int bit);
+
+// frees many bits with a single update of each word, disk byte and counter they touch;
+// returns how many of them were allocated
+int alloc_bitmap_free_many(struct alloc_bitmap* bitmap, int n, const int* bits);
+
+int alloc_bitmap_is_free(const struct alloc_bitmap* bitmap, int bit);
+
+int alloc_bitmap_n_free(const struct alloc_bitmap* bitmap);
+
+int get_group(int bit);
+
+// the group the calling thread should prefer when it has no better hint
+int get_cpu_group(const struct alloc_bitmap* bitmap);
+
+#endif // ALLOC_BITMAP_H
@@ -0,0 +1,13 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+// runs the lines of a batch (see OP_BATCH in protocol.h) and replies with their results;
+// the lines are changed in place.
+// every lock is held throughout, and what the lines change is only published to the lock-free readers
+// (see meta_cache.h) at the end, inodes allocated and freed included: they see the tree before the batch
+// or after it, an atomic batch that is undone not at all. the inodes are published one after the other
+// though, so a reader that happens to look at several of them right then may find some published
+// and some not yet
+int run_batch(char* lines, int atomic);
+
+#endif // BATCH_H
@@ -17,16 +17,31 @@ void write_block(const void* block, int block_id);
 
 int is_correct_block_id(int block_id);
 
-int update_superblock(int delta_free_blocks, int delta_free_inodes);
+// load the block bitmap; call once the disk is initialized
+void init_block_allocator();
 
-int get_n_free_blocks();
+void sync_superblock();
 
-int get_n_free_inodes();
+int get_n_free_blocks();
 
+// allocate in the calling cpu's allocation group if it has free blocks
 int allocate_block();
 
+// allocate in the given allocation group if it has free blocks
+int allocate_block_near(int group);
+
 int free_block(int block_id);
 
+// allocate n blocks that aren't attached to any inode yet; all or nothing.
+// they come in as few runs of consecutive blocks as possible, in order, and aren't cleared
+// since the caller is about to fill them
+int reserve_blocks(int n, int* block_ids);
+
+void release_blocks(int n, const int* block_ids);
+
+// release_blocks() for callers that free inodes as well and sync the superblock once at the end
+void free_blocks(int n, const int* block_ids);
+
 int get_n_blocks_needed(int size);
 
 #endif // SUPERBLOCK_H
@@ -0,0 +1,27 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+
+#include "str_util.h"
+
+// a small LZ77 codec for file data on the wire, fast enough not to be the bottleneck.
+// a compressed stream is a sequence of chunks, each of them a header of two 32-bit numbers in network
+// byte order (raw length, then encoded length with COMPRESS_STORED set if the chunk is kept as it is)
+// followed by the encoded bytes. a chunk that doesn't shrink by at least 1/8 is stored, and the encoder
+// gives up on it as soon as it's clear that it won't, so incompressible data costs little more than a copy
+
+#define COMPRESS_CHUNK_SIZE (64 * 1024)
+#define COMPRESS_STORED     0x80000000u
+
+// the longest a stream of len bytes can get
+size_t compress_bound(size_t len);
+
+// appends the compressed data to out
+void compress_stream(const void* data, size_t len, struct strbuf* out);
+
+// appends the decompressed data to out; -1 if the stream is malformed
+// or would decompress to more than max_len bytes
+int decompress_stream(const void* data, size_t len, struct strbuf* out, size_t max_len);
+
+#endif // COMPRESS_H
@@ -0,0 +1,32 @@
+#ifndef DIR_SCAN_H
+#define DIR_SCAN_H
+
+#include <stdint.h>
+
+#include "inode.h"
+
+// a directory block is a flat array of ENTRIES_PER_BLOCK fixed-size entries,
+// so a whole block can be matched at once and the result returned as a bitmask:
+// bit i is set iff entry i matches
+
+struct dir_scan_kernels {
+    const char* name;
+    int      (*supported)();
+    // entries with a correct inode id and exactly this filename
+    uint32_t (*match_name)(const struct entry* block, const char* filename);
+    // entries pointing to this inode id
+    uint32_t (*match_inode)(const struct entry* block, int inode_id);
+};
+
+// all compiled-in variants, the portable scalar one first
+extern const struct dir_scan_kernels dir_scan_variants[];
+extern const int n_dir_scan_variants;
+
+// dispatch to the best variant supported by the cpu we're running on
+uint32_t dir_scan_name(const void* block, const char* filename);
+
+uint32_t dir_scan_inode(const void* block, int inode_id);
+
+const char* dir_scan_kernel_name();
+
+#endif // DIR_SCAN_H
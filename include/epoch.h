@@ -0,0 +1,18 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+// epoch-based reclamation for data that readers access without locks:
+// a reader brackets its accesses with epoch_enter()/epoch_exit(),
+// a writer replaces a shared pointer and hands the old object to epoch_retire(),
+// which frees it once every reader that could still be looking at it has left.
+// sections nest, and a thread releases its slot automatically when it exits
+
+#define MAX_EPOCH_THREADS 1024
+
+void epoch_enter();
+
+void epoch_exit();
+
+void epoch_retire(void* ptr);
+
+#endif // EPOCH_H
@@ -37,15 +37,14 @@ enum file_type {
 #define DATA_OFFSET (MINIFS_BLOCK_SIZE * 3 + MINIFS_INODE_SIZE * N_INODES)
 #define MAX_FILE_SIZE (N_DIRECT_PTRS * MINIFS_BLOCK_SIZE) // one actual data block for each direct pointer
 
-int disk_fd;
+extern int disk_fd;
 // set to 1 when current "upper level" function was called by another one
-// if 1, success/failure messages over the net are disabled, and locks are not taken
+// if 1, success/failure messages over the net are disabled
+// (locks are re-entrant per thread, see lock.h)
 // yes, it's a crutch
 extern _Thread_local int nested;
 extern _Thread_local int client_fd; // returned by accept()
 extern _Thread_local int work_inode_id;
 extern _Thread_local int user_id;
 
-pthread_rwlock_t lock;
-
 #endif // GLOBALS_H
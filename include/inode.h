@@ -21,6 +21,18 @@ struct entry {
     char   filename[FILENAME_LEN];
 };
 
+#define ENTRIES_PER_BLOCK (MINIFS_BLOCK_SIZE / (int)sizeof(struct entry))
+
+// resumable position inside a directory: index into inode.direct and entry slot within that block
+struct dir_cursor {
+    int block_idx;
+    int slot;
+};
+
+#define DIR_CURSOR_START ((struct dir_cursor){ .block_idx = 0, .slot = 0 })
+
+int dir_cursor_at_end(const struct dir_cursor* cursor);
+
 int get_inode_offset(int inode_id);
 
 int is_correct_inode_id(int inode_id);
@@ -39,14 +51,41 @@ void read_inode(struct inode* inode, int inode_id);
 
 void write_inode(const struct inode* inode, int inode_id);
 
+// read_inode() for up to N_INODES inodes at once, inodes[i] being inode_ids[i]; they're read in the order
+// of the inode table, the ones that aren't cached with one disk read for each run of consecutive ids
+void read_inodes(const int* inode_ids, int n, struct inode* inodes);
+
+// load the inode bitmap; call once the disk is initialized
+void init_inode_allocator();
+
+// until publish_inode_bitmap(), the other threads see the inodes allocated as they are now,
+// for meta_cache_hold()
+void hold_inode_bitmap();
+
+void publish_inode_bitmap();
+
+int get_n_free_inodes();
+
+// allocate in the calling cpu's allocation group if it has free inodes
 int allocate_inode();
 
+// allocate in the same allocation group as inode_id (e.g. the parent directory) if it has free inodes
+int allocate_inode_near(int inode_id);
+
 int free_inode(int inode_id);
 
+// n inodes at once, as close to each other as possible; all or nothing
+int allocate_inodes_near(int inode_id, int n, int* inode_ids);
+
+void free_inodes(int n, const int* inode_ids);
+
 int init_dir(struct inode* inode, int inode_id, int parent_inode_id);
 
 int check_inode_id(int inode_id);
 
+// whether the current user may see the inode
+int check_user_id(int inode_id);
+
 int go(int inode_id, const char* filename);
 
 int file_exists_in_dir(int dir_inode_id, const char* filename);
@@ -69,12 +108,8 @@ void decrement_ref_count(int inode_id);
 
 int add_file_to_dir(int dir_inode_id, int file_inode_id, const char* filename);
 
-void remove_inode_regular(int inode_id);
-
-void remove_inode(int);
-
-void remove_inode_dir(int inode_id);
-
+// frees the inode with its blocks, and everything under it if it's a directory;
+// the whole tree is collected first and then given back to the allocators at once
 void remove_inode(int inode_id);
 
 int get_ref_count(int inode_id);
@@ -85,8 +120,19 @@ int min(int a, int b);
 
 int append_to_file(int inode_id, const void* data, int n_bytes);
 
+// pwrite() for a regular file: only the blocks the range touches are written, new ones are added as needed;
+// -1 if there's no space, in which case nothing changes
+int write_to_file(int inode_id, const void* data, int offset, int n_bytes);
+
+// cuts the file short, freeing the blocks past the new end, or extends it with zeroes
+int resize_file(int inode_id, int size);
+
 int rename_file_in_dir(int dir_inode_id, const char* filename, const char* new_filename);
 
 int get_filename_by_inode(int dir_inode_id, int inode_id, char* filename);
 
+// copy up to max_entries occupied entries starting at *cursor, advancing the cursor past them;
+// each directory block is read once, so a whole listing costs one read per block
+int read_dir_entries(int dir_inode_id, struct dir_cursor* cursor, struct entry* entries, int max_entries);
+
 #endif // INODE_H
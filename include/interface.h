@@ -1,7 +1,13 @@
 #ifndef INTERFACE_H
 #define INTERFACE_H
 
+#include <stddef.h>
+
 #include "globals.h"
+#include "inode.h"
+
+// default number of entries scanned by one readdir request
+#define READDIR_BATCH_SIZE ENTRIES_PER_BLOCK
 
 int change_dir(const char* path);
 
@@ -9,20 +15,60 @@ int remove(const char* path);
 
 int create_file(const char* path, enum file_type file_type);
 
-int list_entries(const char* path, int all);
+// same as create_file(), for callers that have already resolved (and possibly locked) the parent
+int create_file_in_dir(int parent_inode_id, const char* filename, enum file_type file_type);
+
+int list_entries(const char* path, int all, int long_format);
+
+int read_dir(const char* path, int all, int long_format, struct dir_cursor cursor, int max_entries);
+
+// type, size, owner, link count and times of each path
+int stat_files(char** paths, int n_paths);
 
 void display_help();
 
-int copy_from_local(const char* dest_path);
+// an upload whose contents come in ranges, possibly at the same time on several connections;
+// all of its blocks are reserved up front and the file only appears once every range is in
+struct staged_upload;
+
+// NULL if the file can't be created, the failure is already sent
+struct staged_upload* stage_upload(const char* dest_path, size_t size, int n_ranges);
+
+// receives bytes [offset, offset + len) of the file as an OP_DATA message; the connection is dropped
+// if something else arrives instead
+int recv_upload_range(struct staged_upload* upload, size_t offset, size_t len);
+
+// called once for every range, received or not; the last call links the file if all of them were,
+// or gives the blocks back. frees the upload then
+int finish_upload_range(struct staged_upload* upload, int received);
+
+int copy_from_local(const char* dest_path, size_t size);
+
+// an upload whose contents came with the request
+int put_file(const char* dest_path, const char* data, size_t size);
 
 int copy_to_local(const char* src_path);
 
 int copy(const char* src_path, const char* dest_path);
 
+// copies a directory with everything in it that the user may see, under a single acquisition of the locks
+int copy_tree(const char* src_path, const char* dest_path);
+
 int move(const char* src_path, const char* dest_path);
 
 void print_work_path();
 
 int print_contents(const char* path);
 
+// the bytes of a file from offset on, at most length of them
+int read_range(const char* path, long long offset, long long length);
+
+// the size of a regular file, -1 if there's no such file (the failure is sent then)
+int get_file_size(const char* path);
+
+// overwrites size bytes at offset with the data the client sends once told to go ahead
+int write_range(const char* path, long long offset, long long size);
+
+int truncate_file(const char* path, long long size);
+
 #endif // INTERFACE_H
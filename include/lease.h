@@ -0,0 +1,32 @@
+#ifndef LEASE_H
+#define LEASE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "reactor.h"
+
+// a client that asks for it (REQUEST_LEASE) may keep using a listing for LEASE_DURATION seconds
+// without asking again, unless it's told otherwise: whenever a new version of an inode or of
+// a directory's contents is published, the holders of leases on it are sent OP_REVOKE.
+// one that finds another reply being sent on the connection is sent once that's done; a client whose socket
+// doesn't take it right away is hung up on
+
+// the session to grant leases to for the request this thread is serving, NULL if it didn't ask;
+// lease_id is what the revocation carries, the id of that request
+void set_lease_holder(struct conn* conn, uint32_t lease_id);
+
+// grants the current holder a lease on the inode and marks the reply as leased;
+// called before the inode is read for the reply, so that any later change revokes it
+void grant_lease(int inode_id);
+
+void revoke_leases(int inode_id);
+
+// unlocks a connection's send_mutex, then sends the revocations that were held back while it was locked;
+// anything sending on the connection releases it this way
+void release_send_mutex(pthread_mutex_t* send_mutex);
+
+// the connection is about to be freed
+void drop_leases(struct conn* conn);
+
+#endif // LEASE_H
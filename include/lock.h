@@ -1,10 +1,31 @@
 #ifndef LOCK_H
 #define LOCK_H
 
-void write_lock();
+// inodes are protected by a fixed table of reader/writer locks, inode i using stripe i % N_LOCK_STRIPES.
+// a thread may re-lock a stripe it already holds (e.g. go() on a directory the caller has locked),
+// but can't upgrade a read lock to a write lock.
+// lock ordering: stripes in ascending order (use lock_inodes() to take several at once);
+// the allocators don't take locks at all, see alloc_bitmap.h.
+// operations resolve paths before locking, since go() takes read locks of its own
+#define N_LOCK_STRIPES 64
 
-void read_lock();
+enum lock_mode {
+    LOCK_READ,
+    LOCK_WRITE
+};
 
-void unlock();
+// incorrect inode ids (e.g. -1 from a failed lookup) are ignored by all of these
+void lock_inode(int inode_id, enum lock_mode mode);
+
+void unlock_inode(int inode_id);
+
+void lock_inodes(const int* inode_ids, const enum lock_mode* modes, int n);
+
+void unlock_inodes(const int* inode_ids, int n);
+
+// every stripe in write mode, for operations that may touch anything (see batch.h)
+void lock_all();
+
+void unlock_all();
 
 #endif // LOCK_H
@@ -0,0 +1,47 @@
+#ifndef META_CACHE_H
+#define META_CACHE_H
+
+#include "inode.h"
+
+// in-memory versions of the inode table and of directory contents, read without any locks.
+// a writer (holding the inode's write lock) updates the disk first and then publishes
+// a new immutable version; the old one is reclaimed through epoch.h.
+// publishing revokes the clients' leases on the inode, see lease.h
+
+// the directory's allocated blocks, in the order of the inode's direct pointers
+struct dir_snapshot {
+    int          n_blocks;
+    int          direct_idx[N_DIRECT_PTRS]; // position of each block in inode.direct
+    struct entry blocks[][ENTRIES_PER_BLOCK];
+};
+
+// load every inode from disk; call once the disk is initialized, before serving clients
+void meta_cache_init();
+
+// returns -1 if the inode has no version yet
+int cached_read_inode(struct inode* inode, int inode_id);
+
+// many inodes under a single epoch; found[i] is set if inode_ids[i] has a version
+void cached_read_inodes(const int* inode_ids, int n, struct inode* inodes, char* found);
+
+void publish_inode(const struct inode* inode, int inode_id);
+
+// must be called inside epoch_enter()/epoch_exit(), the snapshot is valid until epoch_exit();
+// returns NULL if inode_id isn't a directory
+const struct dir_snapshot* get_dir_snapshot(int dir_inode_id);
+
+// rebuild the directory's snapshot from disk after modifying its blocks, under its write lock
+void publish_dir_snapshot(int dir_inode_id);
+
+void drop_dir_snapshot(int dir_inode_id);
+
+// until meta_cache_publish_held(), what the calling thread publishes is seen by nobody but itself,
+// so that a batch holding every lock (see batch.h) shows the readers its result and nothing in between.
+// that goes for which inodes are allocated too (see hold_inode_bitmap()); the free counts and
+// the block bitmap aren't held, nothing reads those without locks but the free space checks
+void meta_cache_hold();
+
+// publishes what was held back, one inode after the other, then the inode bitmap
+void meta_cache_publish_held();
+
+#endif // META_CACHE_H
@@ -1,19 +1,88 @@
 #ifndef NET_IO_H
 #define NET_IO_H
 
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "protocol.h"
+#include "shm_ring.h"
+
+#define DEFAULT_CHUNK_SIZE (64 * 1024)
+
+// socket and transfer tuning, filled in from the command line before the server starts
+struct net_options {
+    int chunk_size; // bytes moved per call when file data can't go straight between socket and image
+    int sndbuf;     // SO_SNDBUF, 0 keeps the kernel's default
+    int rcvbuf;     // SO_RCVBUF, same
+    int nodelay;    // TCP_NODELAY, so that small replies aren't held back
+    int cork;       // TCP_CORK around replies that go out in several parts
+    int compress;   // honor REQUEST_COMPRESS
+};
+
+extern struct net_options net_options;
+
+// applies net_options to a socket; buffer sizes set on the listening socket are inherited by accepted ones
+// and only then affect the window negotiated in the handshake
+void tune_socket(int fd);
+
+// replies are tagged with the opcode and id of this request;
+// send_mutex serializes them with the replies to other requests on the same connection
+void set_current_request(const struct msg_header* request, pthread_mutex_t* send_mutex);
+
+// append to the payload of the current reply
 void send_nbytes(const void* buf, int n);
 
 void send_msg(const char* buf);
 
+// start the reply, dropping whatever was put into it so far
 void send_success();
 
 void send_failure(const char* msg);
 
+// response flags to send along with the reply, whichever it turns out to be
+void add_reply_flags(uint16_t flags);
+
+// send the reply started by send_success()/send_failure(), if there is one;
+// only needed for intermediate replies, the final one is flushed after the handler returns
+int flush_reply();
+
+// flush_reply() passing the fds along with it, for local sockets only
+int flush_reply_with_fds(const int* fds, int n_fds);
+
+// from now on this thread talks to its client through the channel instead of client_fd
+void set_shm_channel(struct shm_channel* channel);
+
+// a piece of the disk image
+struct disk_range {
+    off_t  offset;
+    size_t len;
+};
+
+// a successful reply whose payload is the given ranges of the disk image, sent right away
+// without copying it through a buffer (sendfile(), falling back to pread() + send());
+// compressed instead if the request asked for it and it pays off
+int send_disk_ranges(const struct disk_range* ranges, int n_ranges);
+
+// fills the given ranges of the disk image with the next bytes from the client, in order,
+// moving them with splice() through a pipe instead of copying them (falling back to recv() + pwrite());
+// -1 if the connection broke first
+int recv_disk_ranges(const struct disk_range* ranges, int n_ranges);
+
+// recv_disk_ranges() for a compressed payload of payload_len bytes; -1 if the connection broke first
+// or the payload doesn't decompress to exactly the ranges, which is reported to the client
+int recv_compressed_disk_ranges(const struct disk_range* ranges, int n_ranges, size_t payload_len);
+
+// reads exactly n bytes, -1 if the connection broke first
 int recv_nbytes(void* buf, int n);
 
-int recv_msg(char buf[]);
+int recv_header(struct msg_header* header);
+
+// for when the client sent something that can't be framed, e.g. a payload of the wrong length:
+// there's no way to find the next request, so the reply is flushed and the connection shut down
+void drop_connection();
 
-void discard_msg();
+// a reply buffer owned by the calling thread, emptied but keeping its capacity between requests
+struct strbuf* get_reply_buf();
 
 
 #endif // NET_IO_H
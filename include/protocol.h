@@ -0,0 +1,115 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+
+#include "globals.h"
+
+// every message, in either direction, is a fixed-size header followed by payload_len bytes of payload.
+// a request's payload is the text of its arguments, e.g. "--all dir" for OP_LS;
+// a response carries the opcode and request id of the request it answers.
+// a client may send requests without waiting for responses; these can arrive in any order
+enum opcode {
+    OP_LOGIN = 1, // payload: user id
+    OP_EXIT,      // no response
+    OP_HELP,
+    OP_PWD,
+    OP_CD,
+    OP_LS,
+    OP_READDIR,
+    OP_COPY,
+    OP_UPLOAD,    // payload: "dest_path size"; answered once to go ahead, then OP_DATA, then the final response
+    OP_DATA,      // payload: raw file contents, tagged with the request id of the upload
+    OP_DOWNLOAD,  // response payload: raw file contents
+    OP_REMOVE,
+    OP_MOVE,
+    OP_MKDIR,
+    OP_TOUCH,
+    OP_CAT,
+    // the same transfers on a data connection of their own, see transfer.h
+    OP_OPEN_UPLOAD,   // payload: as for OP_UPLOAD; response payload: the ticket
+    OP_OPEN_DOWNLOAD, // payload: as for OP_DOWNLOAD; response payload: the ticket
+    OP_ATTACH,        // first request on a data connection, payload: the ticket;
+                      // from then on the connection goes as for the opened request, then it's closed
+    OP_BATCH,         // payload: one operation per line, see below
+    OP_OPEN_SHM,      // local sockets only: the response carries the fds of a shared-memory channel,
+                      // see shm_ring.h; the session goes on there and the socket only stays open until it ends
+    OP_READ,          // payload: "path offset length"; response payload: raw bytes of that range
+    OP_WRITE,         // payload: "path offset size"; answered once to go ahead, then OP_DATA, then the final response
+    OP_TRUNCATE,      // payload: "path size"
+    // a transfer split into ranges that go over data connections of their own at the same time;
+    // response payload: a line "offset length ticket" for each range. an upload range is sent as OP_DATA
+    // right after OP_ATTACH and answered once it's in, the answer to the last one says if the file was created
+    OP_OPEN_PARALLEL_UPLOAD,  // payload: "dest_path size streams"
+    OP_OPEN_PARALLEL_DOWNLOAD, // payload: "path streams"; each range is sent as the response to OP_ATTACH
+    OP_REVOKE,        // from the server, unasked: the lease given with the response to request_id is void, see lease.h
+    OP_PUT,           // payload: "dest_path size\n" followed by the contents; an upload in one message,
+                      // so that many of them can be in flight at once
+    OP_DU,            // see query.h
+    OP_FIND,
+    OP_STAT           // payload: one or more paths
+};
+
+// a batch is mkdir, touch, cp, mv and rm lines written as in the shell, all run under a single
+// acquisition of the locks; the response payload has one enum batch_result byte per line.
+// with REQUEST_ATOMIC, the first failure undoes the lines before it and the rest aren't run
+enum batch_result {
+    BATCH_OK,
+    BATCH_FAILED,
+    BATCH_UNDONE,
+    BATCH_SKIPPED
+};
+
+#define MAX_BATCH_PAYLOAD (1 << 20)
+
+// ranges a parallel transfer may be split into
+#define MAX_TRANSFER_STREAMS 16
+
+enum status {
+    STATUS_OK,
+    STATUS_ERROR // payload is the error message
+};
+
+// request flags
+// the client doesn't care when this write runs relative to its other requests
+#define REQUEST_UNORDERED 0x1
+// OP_BATCH: all or nothing
+#define REQUEST_ATOMIC    0x2
+// OP_LS, OP_READDIR: the client will cache the response if it's given a lease on it
+#define REQUEST_LEASE     0x4
+// file contents in the response go compressed if that makes them smaller, see compress.h;
+// on OP_LOGIN: the client takes compressed responses, and the server says if it sends them
+#define REQUEST_COMPRESS  0x8
+// OP_DATA, OP_PUT: the contents are compressed
+#define REQUEST_COMPRESSED 0x10
+
+// response flags
+// the response holds for LEASE_DURATION seconds from when the request was sent, unless it's revoked
+#define RESPONSE_LEASED   0x1
+// the payload is compressed; on the response to OP_LOGIN: REQUEST_COMPRESS is honored
+#define RESPONSE_COMPRESSED 0x2
+
+#define LEASE_DURATION 10
+
+struct msg_header {
+    uint8_t  opcode;
+    uint8_t  status;
+    uint16_t flags;
+    uint32_t request_id;
+    uint32_t payload_len;
+};
+
+// on the wire: opcode, status, then flags, request id and payload length in network byte order
+#define MSG_HEADER_SIZE 12
+
+// requests other than OP_DATA must fit into this
+#define MAX_REQUEST_PAYLOAD MINIFS_BLOCK_SIZE
+
+// the largest payload a request with this opcode may have
+uint32_t max_request_payload(uint8_t opcode);
+
+void encode_header(const struct msg_header* header, unsigned char out[MSG_HEADER_SIZE]);
+
+void decode_header(const unsigned char in[MSG_HEADER_SIZE], struct msg_header* header);
+
+#endif // PROTOCOL_H
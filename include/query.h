@@ -0,0 +1,28 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+// du and find: the tree is walked on the server with the lock-free readers (see meta_cache.h),
+// so a whole subtree costs one request. with n_threads > 1 the subtrees of the starting directory
+// are walked in parallel; the output is the same either way
+#define MAX_QUERY_THREADS 16
+
+// a predicate on a number: '+' for greater than, '-' for less than, '=' for equal, 0 for any
+struct query_cmp {
+    char      op;
+    long long value;
+};
+
+struct find_filter {
+    const char*      name;  // shell pattern for the file name, NULL for any
+    char             type;  // 'f', 'd' or 0 for any
+    struct query_cmp size;  // in bytes
+    struct query_cmp mtime; // in whole days since the last modification
+};
+
+// a line "KiB<tab>path" for each directory, its subdirectories first, or only for the starting one with summarize
+int disk_usage(const char* path, int summarize, int n_threads);
+
+// a line with the path of each file that matches, directories before their contents
+int find_files(const char* path, const struct find_filter* filter, int n_threads);
+
+#endif // QUERY_H
@@ -0,0 +1,58 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <pthread.h>
+
+#include "globals.h"
+#include "protocol.h"
+
+#define DEFAULT_N_EVENT_LOOPS 2
+
+enum conn_state {
+    CONN_LOGIN,   // waiting for the user id
+    CONN_OPEN,
+    CONN_CLOSING  // the session is over, the connection is freed once no request is running
+};
+
+struct conn;
+
+// a complete request; requests of one connection may run concurrently, see must_run_alone()
+struct request {
+    struct conn*      conn;
+    struct msg_header header;
+    char*             payload; // null-terminated
+};
+
+// everything that's kept about a connected client between its requests,
+// so an idle client costs this struct and nothing else
+struct conn {
+    int             fd;
+    int             epoll_fd; // of the event loop watching it
+    // only changed by requests that run alone
+    int             user_id;
+    int             work_inode_id;
+
+    pthread_mutex_t mutex; // guards the fields below
+    enum conn_state state; // the handler may change it without the mutex while running alone
+    int             n_running;
+    struct request* waiting; // has to run alone, waits for the running ones to finish
+
+    pthread_mutex_t send_mutex; // responses of concurrent requests mustn't interleave
+
+    // the request being received by the event loop: header first, then its payload
+    int             in_len; // bytes of the header and payload received so far
+    unsigned char   in_header[MSG_HEADER_SIZE];
+    struct request* in_request;
+};
+
+// requests are handled by a worker pool of n_workers threads started here;
+// handle_request runs on a worker thread with client_fd, user_id and work_inode_id set up for the connection;
+// whatever reply it leaves pending is sent after it returns.
+// it sets conn->state to CONN_CLOSING to end the session
+void start_reactor(int n_event_loops, int n_workers, int queue_capacity,
+                   void (*handle_request)(struct request* request));
+
+// start watching a freshly accepted socket
+void reactor_add_connection(int fd);
+
+#endif // REACTOR_H
@@ -0,0 +1,62 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// a transport for clients on the same host: the messages of protocol.h go through a pair of
+// single-producer single-consumer byte rings in a memfd instead of a socket.
+// each side has an eventfd that the other one signals, but only when it's about to block on it
+
+#define SHM_RING_SIZE (256 * 1024) // a power of two
+
+struct shm_ring {
+    // running byte counts, wrapping around; positions in data are taken modulo SHM_RING_SIZE
+    _Alignas(64) _Atomic uint32_t head; // written so far, only moved by the producer
+    _Alignas(64) _Atomic uint32_t tail; // read so far, only moved by the consumer
+    _Alignas(64) char data[SHM_RING_SIZE];
+};
+
+struct shm_area {
+    struct shm_ring requests;  // client to server
+    struct shm_ring responses; // server to client
+    _Alignas(64) _Atomic int server_sleeping;
+    _Alignas(64) _Atomic int client_sleeping;
+};
+
+// the fds that make up a channel, in the order they're passed to the client
+enum {
+    SHM_MEM_FD,
+    SHM_SERVER_EVENT_FD, // the server waits on it
+    SHM_CLIENT_EVENT_FD,
+    SHM_N_FDS
+};
+
+// one side's end of an area
+struct shm_channel {
+    struct shm_area* area;
+    struct shm_ring* tx;
+    struct shm_ring* rx;
+    _Atomic int*     sleeping;
+    _Atomic int*     peer_sleeping;
+    int              event_fd;
+    int              peer_event_fd;
+    int              hangup_fd; // becomes readable once the other side is gone, -1 if there's no such thing
+};
+
+// a new area and its eventfds, -1 on failure
+int shm_create(int fds[SHM_N_FDS]);
+
+// maps the area and takes over the eventfds and hangup_fd; the memfd isn't needed after that. -1 on failure
+int shm_attach(struct shm_channel* channel, const int fds[SHM_N_FDS], int server_side, int hangup_fd);
+
+// unmaps the area and closes the eventfds and hangup_fd
+void shm_detach(struct shm_channel* channel);
+
+// both block until all n bytes are through, -1 if the other side went away
+int shm_send(struct shm_channel* channel, const void* buf, size_t n);
+
+int shm_recv(struct shm_channel* channel, void* buf, size_t n);
+
+#endif // SHM_RING_H
@@ -0,0 +1,12 @@
+#ifndef SHM_SESSION_H
+#define SHM_SESSION_H
+
+#include "reactor.h"
+
+// moves the logged-in session of a local connection to a shared-memory channel (see shm_ring.h):
+// replies with the channel's fds, then serves its requests with handle_request on a thread of its own,
+// one at a time and in order. the reactor lets go of the connection, the session keeps the socket
+// only to notice the client going away
+int open_shm_session(struct conn* conn, void (*handle_request)(struct request* request));
+
+#endif // SHM_SESSION_H
@@ -1,6 +1,16 @@
 #ifndef STR_UTIL_H
 #define STR_UTIL_H
 
+#include <stddef.h>
+
+// growable byte buffer, used to pack multi-part replies into a single send;
+// data is always null-terminated so text replies can be printed directly
+struct strbuf {
+    char*  data;
+    size_t len;
+    size_t cap;
+};
+
 char** split_str(const char* const_str, const char* delim);
 
 char** split_path(const char* path_str);
@@ -9,4 +19,15 @@ void free_tokens(char** tokens);
 
 void reverse_str(char* str);
 
+void strbuf_init(struct strbuf* sb);
+
+void strbuf_free(struct strbuf* sb);
+
+// drop the contents but keep the memory for reuse
+void strbuf_reset(struct strbuf* sb);
+
+void strbuf_append(struct strbuf* sb, const void* data, size_t n);
+
+void strbuf_appendf(struct strbuf* sb, const char* fmt, ...);
+
 #endif // STR_UTIL_H
@@ -0,0 +1,39 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stddef.h>
+
+#include "protocol.h"
+
+// file transfers negotiated on a control connection and carried out on a data connection of their own,
+// so the control connection stays free and a session can run several transfers at once.
+// the data connection presents the ticket it got from the control connection instead of logging in
+#define MAX_PENDING_TRANSFERS 256
+#define TRANSFER_TIMEOUT      30 // seconds a ticket stays valid if nobody claims it
+#define TICKET_LEN            32
+
+struct staged_upload;
+
+struct transfer {
+    enum opcode opcode;                     // OP_UPLOAD, OP_DOWNLOAD or OP_READ
+    char        args[MAX_REQUEST_PAYLOAD + 1]; // same as for that request on a control connection
+    int         user_id;                    // of the session that opened it
+    int         work_inode_id;
+    // set instead for one range of a parallel upload
+    struct staged_upload* upload;
+    size_t                offset;
+    size_t                len;
+    // called if the ticket expires unclaimed, with the tickets locked; NULL if there's nothing to clean up
+    void (*abandon)(struct transfer* transfer);
+};
+
+// returns -1 if too many transfers are pending; the ticket is "id secret"
+int open_transfer(const struct transfer* transfer, char ticket[TICKET_LEN]);
+
+// hands out the transfer once; -1 if the ticket is unknown, already used or expired
+int claim_transfer(const char* ticket, struct transfer* transfer);
+
+// lets go of whatever expired tickets hold on to; opening and claiming do it as well
+void expire_transfers();
+
+#endif // TRANSFER_H
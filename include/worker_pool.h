@@ -0,0 +1,14 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+// a fixed set of threads running jobs from a bounded queue;
+// the threads live as long as the server, each one handles many jobs in turn
+#define DEFAULT_N_WORKERS      16
+#define DEFAULT_QUEUE_CAPACITY 1024
+
+void start_worker_pool(int n_workers, int queue_capacity, void (*handle_job)(void* job));
+
+// blocks while the queue is full
+void submit_job(void* job);
+
+#endif // WORKER_POOL_H
@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <sched.h>
+
+#include "alloc_bitmap.h"
+#include "disk_io.h"
+
+_Static_assert(ALLOC_GROUP_SIZE == 64, "a group is exactly one bitmap word");
+
+void alloc_bitmap_init(struct alloc_bitmap* bitmap, int n_bits, int disk_offset) {
+    bitmap->n_bits      = n_bits;
+    bitmap->n_groups    = (n_bits + ALLOC_GROUP_SIZE - 1) / ALLOC_GROUP_SIZE;
+    bitmap->disk_offset = disk_offset;
+    bitmap->words       = calloc(bitmap->n_groups, sizeof(_Atomic uint64_t));
+    bitmap->group_free  = calloc(bitmap->n_groups, sizeof(_Atomic int));
+
+    unsigned char bytes[(n_bits + 7) / 8];
+    read_data(bytes, sizeof(bytes), disk_offset);
+    int total_free = 0;
+    for (int bit = 0; bit < n_bits; ++bit) {
+        if (bytes[bit / 8] & (1 << (bit % 8))) {
+            atomic_fetch_or(bitmap->words + bit / 64, 1ull << (bit % 64));
+            atomic_fetch_add(bitmap->group_free + get_group(bit), 1);
+            ++total_free;
+        }
+    }
+    atomic_store(&bitmap->total_free, total_free);
+}
+
+static unsigned char get_byte(const struct alloc_bitmap* bitmap, int bit) {
+    return (unsigned char)(atomic_load(bitmap->words + bit / 64) >> (bit % 64 / 8 * 8));
+}
+
+// concurrent updates of the same byte may be written out of order,
+// so whoever wrote last makes sure the disk ends up with the latest value
+static void write_through(const struct alloc_bitmap* bitmap, int bit) {
+    unsigned char written;
+    do {
+        written = get_byte(bitmap, bit);
+        write_data(&written, 1, bitmap->disk_offset + bit / 8);
+    } while (get_byte(bitmap, bit) != written);
+}
+
+// take one unit from a counter unless it's already zero
+static int try_reserve(_Atomic int* counter) {
+    int value = atomic_load(counter);
+    while (value > 0) {
+        if (atomic_compare_exchange_weak(counter, &value, value - 1)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int alloc_bitmap_allocate(struct alloc_bitmap* bitmap, int preferred_group) {
+    if (try_reserve(&bitmap->total_free) == -1) {
+        return -1;
+    }
+    // the total reserved for us is backed by some group's counter,
+    // and a group's counter never exceeds the number of its set bits
+    for (int i = 0;; ++i) {
+        int group = (preferred_group + i) % bitmap->n_groups;
+        if (try_reserve(bitmap->group_free + group) == -1) {
+            continue;
+        }
+        _Atomic uint64_t* word = bitmap->words + group;
+        uint64_t value = atomic_load(word);
+        while (1) {
+            if (value == 0) {
+                // a unit is reserved for us, so the bit being freed concurrently is about to show up
+                value = atomic_load(word);
+                continue;
+            }
+            uint64_t claimed = value & -value;
+            if (atomic_compare_exchange_weak(word, &value, value & ~claimed)) {
+                int bit = group * 64 + __builtin_ctzll(claimed);
+                write_through(bitmap, bit);
+                return bit;
+            }
+        }
+    }
+}
+
+// take up to n units from a counter, returns how many were taken
+static int try_reserve_upto(_Atomic int* counter, int n) {
+    int value = atomic_load(counter);
+    while (value > 0) {
+        int taken = (value < n ? value : n);
+        if (atomic_compare_exchange_weak(counter, &value, value - taken)) {
+            return taken;
+        }
+    }
+    return 0;
+}
+
+static uint64_t get_run_mask(int start, int len) {
+    return (len == 64 ? ~0ull : ((1ull << len) - 1) << start);
+}
+
+// the longest run of set bits, cut to max_len
+static int find_run(uint64_t value, int max_len, int* start) {
+    int best = 0;
+    while (value != 0 && best < max_len) {
+        int low = __builtin_ctzll(value);
+        uint64_t rest = ~(value >> low);
+        int len = (rest == 0 ? 64 - low : __builtin_ctzll(rest));
+        if (len > best) {
+            best = len;
+            *start = low;
+        }
+        value &= ~get_run_mask(low, len);
+    }
+    return (best < max_len ? best : max_len);
+}
+
+int alloc_bitmap_allocate_run(struct alloc_bitmap* bitmap, int preferred_group, int max_len, int* first_bit) {
+    int reserved = try_reserve_upto(&bitmap->total_free, max_len);
+    if (reserved == 0) {
+        return 0;
+    }
+    // same as alloc_bitmap_allocate(), except that whatever doesn't fit into the run is given back
+    for (int i = 0;; ++i) {
+        int group = (preferred_group + i) % bitmap->n_groups;
+        int group_reserved = try_reserve_upto(bitmap->group_free + group, reserved);
+        if (group_reserved == 0) {
+            continue;
+        }
+        _Atomic uint64_t* word = bitmap->words + group;
+        uint64_t value = atomic_load(word);
+        while (1) {
+            int start = 0;
+            int len = find_run(value, group_reserved, &start);
+            if (len == 0) {
+                value = atomic_load(word);
+                continue;
+            }
+            if (atomic_compare_exchange_weak(word, &value, value & ~get_run_mask(start, len))) {
+                *first_bit = group * 64 + start;
+                for (int bit = *first_bit; bit < *first_bit + len; bit = (bit / 8 + 1) * 8) {
+                    write_through(bitmap, bit);
+                }
+                atomic_fetch_add(bitmap->group_free + group, group_reserved - len);
+                atomic_fetch_add(&bitmap->total_free, reserved - len);
+                return len;
+            }
+        }
+    }
+}
+
+int alloc_bitmap_free(struct alloc_bitmap* bitmap, int bit) {
+    uint64_t mask = 1ull << (bit % 64);
+    if (atomic_fetch_or(bitmap->words + bit / 64, mask) & mask) {
+        return -1;
+    }
+    write_through(bitmap, bit);
+    atomic_fetch_add(bitmap->group_free + get_group(bit), 1);
+    atomic_fetch_add(&bitmap->total_free, 1);
+    return 0;
+}
+
+int alloc_bitmap_free_many(struct alloc_bitmap* bitmap, int n, const int* bits) {
+    uint64_t* masks = calloc(bitmap->n_groups, sizeof(uint64_t));
+    for (int i = 0; i < n; ++i) {
+        masks[bits[i] / 64] |= 1ull << (bits[i] % 64);
+    }
+    int n_freed = 0;
+    for (int word = 0; word < bitmap->n_groups; ++word) {
+        if (masks[word] == 0) {
+            continue;
+        }
+        uint64_t freed = ~atomic_fetch_or(bitmap->words + word, masks[word]) & masks[word];
+        for (int byte = 0; byte < 8; ++byte) {
+            if ((freed >> (byte * 8)) & 0xff) {
+                write_through(bitmap, word * 64 + byte * 8);
+            }
+        }
+        atomic_fetch_add(bitmap->group_free + word, __builtin_popcountll(freed));
+        n_freed += __builtin_popcountll(freed);
+    }
+    atomic_fetch_add(&bitmap->total_free, n_freed);
+    free(masks);
+    return n_freed;
+}
+
+int alloc_bitmap_is_free(const struct alloc_bitmap* bitmap, int bit) {
+    return (atomic_load_explicit(bitmap->words + bit / 64, memory_order_acquire) >> (bit % 64)) & 1;
+}
+
+int alloc_bitmap_n_free(const struct alloc_bitmap* bitmap) {
+    return atomic_load(&bitmap->total_free);
+}
+
+int get_group(int bit) {
+    return bit / ALLOC_GROUP_SIZE;
+}
+
+int get_cpu_group(const struct alloc_bitmap* bitmap) {
+    int cpu = sched_getcpu();
+    return (cpu < 0 ? 0 : cpu % bitmap->n_groups);
+}
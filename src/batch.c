@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+#include "globals.h"
+#include "inode.h"
+#include "interface.h"
+#include "lock.h"
+#include "meta_cache.h"
+#include "net_io.h"
+#include "protocol.h"
+#include "str_util.h"
+
+// how to take back a line that went through, for atomic batches
+struct undo {
+    enum {
+        UNDO_CREATE, // remove path
+        UNDO_MOVE,   // move path back to old_path
+        UNDO_REMOVE  // link inode_id back as path; until the batch is over, the removed inode is kept
+                     // alive by an extra reference
+    } kind;
+    char* path;
+    char* old_path;
+    int   inode_id;
+};
+
+struct undo_log {
+    struct undo* entries;
+    int          n;
+    int          cap;
+};
+
+// log is NULL when nothing is going to be undone
+static void log_undo(struct undo_log* log, int kind, const char* path, const char* old_path, int inode_id) {
+    if (log == NULL) {
+        return;
+    }
+    if (log->n == log->cap) {
+        log->cap = (log->cap == 0 ? 16 : 2 * log->cap);
+        log->entries = realloc(log->entries, log->cap * sizeof(struct undo));
+    }
+    struct undo* undo = log->entries + log->n++;
+    undo->kind     = kind;
+    undo->path     = strdup(path);
+    undo->old_path = (old_path == NULL ? NULL : strdup(old_path));
+    undo->inode_id = inode_id;
+}
+
+static void relink(const char* path, int inode_id) {
+    int parent_inode_id;
+    char* filename;
+    get_parent_and_filename(path, &parent_inode_id, &filename);
+    add_file_to_dir(parent_inode_id, inode_id, filename);
+    free(filename);
+}
+
+// in reverse, so that every entry sees the tree as it was right after its line
+static void undo_all(struct undo_log* log) {
+    for (int i = log->n - 1; i >= 0; --i) {
+        struct undo* undo = log->entries + i;
+        if (undo->kind == UNDO_CREATE) {
+            remove(undo->path);
+        } else if (undo->kind == UNDO_MOVE) {
+            move(undo->path, undo->old_path);
+        } else {
+            relink(undo->path, undo->inode_id);
+            decrement_ref_count(undo->inode_id);
+        }
+    }
+}
+
+// the removals are final now
+static void commit_all(struct undo_log* log) {
+    for (int i = 0; i < log->n; ++i) {
+        if (log->entries[i].kind == UNDO_REMOVE) {
+            decrement_ref_count(log->entries[i].inode_id);
+        }
+    }
+}
+
+static void free_undo_log(struct undo_log* log) {
+    for (int i = 0; i < log->n; ++i) {
+        free(log->entries[i].path);
+        free(log->entries[i].old_path);
+    }
+    free(log->entries);
+}
+
+// returns -1 if the line failed
+static int run_line(char** tokens, struct undo_log* log) {
+    if (tokens[0] == NULL || tokens[1] == NULL) {
+        return -1;
+    }
+    const char* cmd = tokens[0];
+    if (strcmp(cmd, "mkdir") == 0 || strcmp(cmd, "touch") == 0) {
+        if (create_file(tokens[1], (strcmp(cmd, "mkdir") == 0 ? DIRECTORY : REGULAR_FILE)) == -1) {
+            return -1;
+        }
+        log_undo(log, UNDO_CREATE, tokens[1], NULL, -1);
+        return 0;
+    }
+    if (strcmp(cmd, "rm") == 0) {
+        int inode_id = traverse(tokens[1]);
+        if (log != NULL && inode_id != -1) {
+            increment_ref_count(inode_id);
+        }
+        if (remove(tokens[1]) == -1) {
+            if (log != NULL && inode_id != -1) {
+                decrement_ref_count(inode_id);
+            }
+            return -1;
+        }
+        log_undo(log, UNDO_REMOVE, tokens[1], NULL, inode_id);
+        return 0;
+    }
+    if (tokens[2] == NULL) {
+        return -1;
+    }
+    if (strcmp(cmd, "cp") == 0 && strcmp(tokens[1], "-r") == 0) {
+        if (tokens[3] == NULL || copy_tree(tokens[2], tokens[3]) == -1) {
+            return -1;
+        }
+        log_undo(log, UNDO_CREATE, tokens[3], NULL, -1);
+        return 0;
+    }
+    if (strcmp(cmd, "cp") == 0) {
+        if (copy(tokens[1], tokens[2]) == -1) {
+            return -1;
+        }
+        log_undo(log, UNDO_CREATE, tokens[2], NULL, -1);
+        return 0;
+    }
+    if (strcmp(cmd, "mv") == 0) {
+        if (move(tokens[1], tokens[2]) == -1) {
+            return -1;
+        }
+        log_undo(log, UNDO_MOVE, tokens[2], tokens[1], -1);
+        return 0;
+    }
+    return -1;
+}
+
+int run_batch(char* lines, int atomic) {
+    struct strbuf* results = get_reply_buf();
+    struct undo_log undo_log = { 0 };
+    // without atomic there's nothing to undo
+    struct undo_log* log = (atomic ? &undo_log : NULL);
+    int n_failed = 0;
+
+    lock_all();
+    // the readers that don't lock only get to see how the batch ends
+    meta_cache_hold();
+    char* saveptr = NULL;
+    for (char* line = strtok_r(lines, "\n", &saveptr); line != NULL; line = strtok_r(NULL, "\n", &saveptr)) {
+        unsigned char result = BATCH_SKIPPED;
+        if (!atomic || n_failed == 0) {
+            char** tokens = split_str(line, " ");
+            // the operations report to us, not to the client
+            nested = 1;
+            result = (run_line(tokens, log) == -1 ? BATCH_FAILED : BATCH_OK);
+            nested = 0;
+            free_tokens(tokens);
+        }
+        n_failed += (result == BATCH_FAILED);
+        strbuf_append(results, &result, 1);
+    }
+    nested = 1;
+    if (atomic && n_failed > 0) {
+        undo_all(log);
+        for (size_t i = 0; i < results->len; ++i) {
+            if (results->data[i] == BATCH_OK) {
+                results->data[i] = BATCH_UNDONE;
+            }
+        }
+    } else if (atomic) {
+        commit_all(log);
+    }
+    nested = 0;
+    meta_cache_publish_held();
+    unlock_all();
+    free_undo_log(&undo_log);
+
+    if (n_failed > 0) {
+        send_failure("");
+    } else {
+        send_success();
+    }
+    send_nbytes(results->data, results->len);
+    return (n_failed > 0 ? -1 : 0);
+}
@@ -4,7 +4,8 @@
 #include "block.h"
 #include "globals.h"
 #include "disk_io.h"
-#include "bit_util.h"
+#include "inode.h"
+#include "alloc_bitmap.h"
 
 void read_superblock(struct superblock* sb) {
     read_data(sb, sizeof(struct superblock), 0);
@@ -28,49 +29,37 @@ int is_correct_block_id(int block_id) {
     return 0 <= block_id && block_id < N_BLOCKS;
 }
 
-int update_superblock(int delta_free_blocks, int delta_free_inodes) {
-    struct superblock sb;
-    read_superblock(&sb);
-    int new_n_free_blocks = sb.n_free_blocks + delta_free_blocks;
-    int new_n_free_inodes = sb.n_free_inodes + delta_free_inodes;
-    if (new_n_free_blocks < 0 || new_n_free_blocks > N_BLOCKS || new_n_free_inodes < 0 || new_n_free_inodes > N_INODES) {
-        return -1;
-    }
-    sb.n_free_blocks = new_n_free_blocks;
-    sb.n_free_inodes = new_n_free_inodes;
-    write_superblock(&sb);
-    return 0;
+static struct alloc_bitmap block_bitmap;
+
+void init_block_allocator() {
+    alloc_bitmap_init(&block_bitmap, N_BLOCKS, MINIFS_BLOCK_SIZE);
 }
 
-int get_n_free_blocks() {
-    struct superblock sb;
-    read_superblock(&sb);
-    return sb.n_free_blocks;
+// the free counters live in memory, the superblock just mirrors them;
+// like the bitmap bytes, it's rewritten until it matches what's in memory
+void sync_superblock() {
+    struct superblock sb = { .magic = MAGIC };
+    do {
+        sb.n_free_blocks = get_n_free_blocks();
+        sb.n_free_inodes = get_n_free_inodes();
+        write_superblock(&sb);
+    } while (sb.n_free_blocks != get_n_free_blocks() || sb.n_free_inodes != get_n_free_inodes());
 }
 
-int get_n_free_inodes() {
-    struct superblock sb;
-    read_superblock(&sb);
-    return sb.n_free_inodes;
+int get_n_free_blocks() {
+    return alloc_bitmap_n_free(&block_bitmap);
 }
 
 int allocate_block() {
-    if (update_superblock(-1, 0) == -1) {
+    return allocate_block_near(get_cpu_group(&block_bitmap));
+}
+
+int allocate_block_near(int group) {
+    int allocated_block_id = alloc_bitmap_allocate(&block_bitmap, group);
+    if (allocated_block_id == -1) {
         return -1;
     }
-    int allocated_block_id = -1;
-
-    char block_bitmap[N_BLOCKS / 8];
-    read_block_bitmap(block_bitmap);
-    for (int i = 0; i < N_BLOCKS / 8; ++i) {
-        int index = first_bit(block_bitmap[i]);
-        if (index != -1) {
-            allocated_block_id = i * 8 + index;
-            set_zero(block_bitmap + i, index);
-            break;
-        }
-    }
-    write_block_bitmap(block_bitmap);
+    sync_superblock();
 
     char buf[MINIFS_BLOCK_SIZE];
     memset(buf, -1, sizeof buf);
@@ -80,23 +69,40 @@ int allocate_block() {
 }
 
 int free_block(int block_id) {
-    if (!is_correct_block_id(block_id) || update_superblock(1, 0) == -1) {
+    if (!is_correct_block_id(block_id) || alloc_bitmap_free(&block_bitmap, block_id) == -1) {
         return -1;
     }
+    sync_superblock();
+    return 0;
+}
 
-    // we don't actually need the whole bitmap like when allocating, just one tiny byte
-    char byte;
-    read_data(&byte, 1, MINIFS_BLOCK_SIZE + block_id / 8);
-    if (is_one(byte, block_id % 8)) {
-        // block wasn't allocated
-        return -1;
+int reserve_blocks(int n, int* block_ids) {
+    int group = get_cpu_group(&block_bitmap);
+    for (int n_reserved = 0; n_reserved < n; ) {
+        int first_block_id;
+        int len = alloc_bitmap_allocate_run(&block_bitmap, group, n - n_reserved, &first_block_id);
+        if (len == 0) {
+            release_blocks(n_reserved, block_ids);
+            return -1;
+        }
+        for (int i = 0; i < len; ++i) {
+            block_ids[n_reserved++] = first_block_id + i;
+        }
+        group = get_group(first_block_id);
     }
-    set_one(&byte, block_id % 8);
-    write_data(&byte, 1, MINIFS_BLOCK_SIZE + block_id / 8);
-
+    sync_superblock();
     return 0;
 }
 
+void release_blocks(int n, const int* block_ids) {
+    free_blocks(n, block_ids);
+    sync_superblock();
+}
+
+void free_blocks(int n, const int* block_ids) {
+    alloc_bitmap_free_many(&block_bitmap, n, block_ids);
+}
+
 int get_n_blocks_needed(int size) {
     int n_blocks_needed = (size + MINIFS_BLOCK_SIZE - 1) / MINIFS_BLOCK_SIZE; // round up
                                 // need an additional indirection level
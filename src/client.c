@@ -3,141 +3,537 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
-#include <time.h>
+#include <stdint.h>
 #include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <dirent.h>
+#include <time.h>
 
 #include "globals.h"
 #include "str_util.h"
+#include "protocol.h"
+#include "shm_ring.h"
+#include "compress.h"
+
+// file data is moved in pieces this big
+#define CHUNK_SIZE (64 * 1024)
 
-int con_fd;
+const char* server_ip;
+int server_port;
+const char* local_path; // of the server's local socket, used instead of TCP if set
+int con_fd; // the control connection
+int use_shm; // con_fd is only kept open, the control connection goes through shm
+int use_compression; // file data goes compressed both ways, agreed on at login
+struct shm_channel shm;
 char buf[MINIFS_BLOCK_SIZE];
 char work_path[MAX_PATH_LEN];
+uint32_t last_request_id;
+struct msg_header response_header;
+struct strbuf response; // payload of the last response
+
+int connect_to_local_server() {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        puts("couldn't create socket");
+        exit(1);
+    }
+    struct sockaddr_un serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sun_family = AF_UNIX;
+    if (strlen(local_path) >= sizeof(serv_addr.sun_path)) {
+        puts("invalid address");
+        exit(1);
+    }
+    strcpy(serv_addr.sun_path, local_path);
+    if (connect(fd, (struct sockaddr*)(&serv_addr), sizeof(serv_addr)) < 0) {
+        puts("connection failed");
+        exit(1);
+    }
+    return fd;
+}
 
-void create_connection(const char* ip, int port) {
-    con_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (con_fd < 0) {
+int connect_to_server() {
+    if (local_path != NULL) {
+        return connect_to_local_server();
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
         puts("couldn't create socket");
         exit(1);
     }
-    if (setsockopt(con_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0) {
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0) {
         puts("setsockopt error");
     }
+    // requests are small and every one of them is waited for
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
     struct sockaddr_in serv_addr;
     serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(port);
-    if (inet_pton(AF_INET, ip, &serv_addr.sin_addr) != 1) {
+    serv_addr.sin_port = htons(server_port);
+    if (inet_pton(AF_INET, server_ip, &serv_addr.sin_addr) != 1) {
         puts("invalid address");
         exit(1);
     }
-    if (connect(con_fd, (struct sockaddr*)(&serv_addr), sizeof(serv_addr)) < 0) {
+    if (connect(fd, (struct sockaddr*)(&serv_addr), sizeof(serv_addr)) < 0) {
         puts("connection failed");
         exit(1);
     }
-    fcntl(con_fd, F_SETFL, fcntl(con_fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
 }
 
-void send_nbytes(const void* buf, int n) {
-    send(con_fd, buf, n, 0);
+void send_all(int fd, const void* buf, int n) {
+    if (fd == con_fd && use_shm) {
+        if (shm_send(&shm, buf, n) == -1) {
+            puts("connection broke");
+            exit(1);
+        }
+        return;
+    }
+    const char* ptr = buf;
+    while (n > 0) {
+        ssize_t sent = send(fd, ptr, n, 0);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            puts("connection broke");
+            exit(1);
+        }
+        ptr += sent;
+        n -= sent;
+    }
 }
 
-void send_msg(const char* buf) {
-    send_nbytes(buf, strlen(buf));
+void recv_all(int fd, void* buf, int n) {
+    if (fd == con_fd && use_shm) {
+        if (shm_recv(&shm, buf, n) == -1) {
+            puts("connection broke");
+            exit(1);
+        }
+        return;
+    }
+    char* ptr = buf;
+    while (n > 0) {
+        ssize_t received = recv(fd, ptr, n, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            puts("connection broke");
+            exit(1);
+        }
+        ptr += received;
+        n -= received;
+    }
 }
 
-void get_cmd() {
-    fgets(buf, sizeof(buf), stdin);
-    if (buf[strlen(buf) - 1] == '\n') {
-        buf[strlen(buf) - 1] = '\0';
+void send_header_to(int fd, enum opcode opcode, uint16_t flags, uint32_t request_id, uint32_t payload_len) {
+    struct msg_header header = {
+        .opcode      = opcode,
+        .status      = STATUS_OK,
+        .flags       = flags,
+        .request_id  = request_id,
+        .payload_len = payload_len
+    };
+    unsigned char buf[MSG_HEADER_SIZE];
+    encode_header(&header, buf);
+    send_all(fd, buf, sizeof(buf));
+}
+
+// listings are kept for as long as the server leases them (see lease.h), so that repeating one
+// costs no round trip; the server tells us when a directory on the way changes.
+// our own changes drop the whole cache, they may touch any listing
+#define CACHE_SIZE 64
+#define N_REVOKED  64
+
+struct cached_listing {
+    char*         key; // NULL if the slot is free
+    uint32_t      lease_id;
+    time_t        expires;
+    int           success;
+    struct strbuf payload;
+} cache[CACHE_SIZE];
+int next_cache_slot;
+// a revocation can overtake the response carrying the lease, so the last few are remembered
+uint32_t revoked[N_REVOKED];
+int next_revoked;
+
+int is_cacheable(enum opcode opcode) {
+    // the server has no way to revoke leases over shared memory
+    return !use_shm && (opcode == OP_LS || opcode == OP_READDIR);
+}
+
+// relative paths depend on the working directory
+char* make_cache_key(enum opcode opcode, const char* args) {
+    char* key = malloc(strlen(work_path) + strlen(args) + 16);
+    sprintf(key, "%d %s\n%s", opcode, work_path, args);
+    return key;
+}
+
+void free_cached(struct cached_listing* cached) {
+    free(cached->key);
+    cached->key = NULL;
+}
+
+struct cached_listing* find_cached(const char* key) {
+    time_t now = time(NULL);
+    for (int i = 0; i < CACHE_SIZE; ++i) {
+        if (cache[i].key != NULL && cache[i].expires <= now) {
+            free_cached(cache + i);
+        }
+        if (cache[i].key != NULL && strcmp(cache[i].key, key) == 0) {
+            return cache + i;
+        }
     }
+    return NULL;
 }
 
-// milliseconds
-void sleep_for(int ms) {
-    struct timespec ts = {
-        .tv_sec = (ms / 1000),
-        .tv_nsec = (ms % 1000) * (int)(1e6)
-    };
-    nanosleep(&ts, &ts);
+// keeps the response just received under the key, if it came with a lease that's still good;
+// sent is when the request went out, the lease runs from then on. takes ownership of the key
+void cache_listing(char* key, time_t sent, int success) {
+    int is_revoked = 0;
+    for (int i = 0; i < N_REVOKED; ++i) {
+        is_revoked |= (revoked[i] == response_header.request_id);
+    }
+    if (!(response_header.flags & RESPONSE_LEASED) || is_revoked || find_cached(key) != NULL) {
+        free(key);
+        return;
+    }
+    struct cached_listing* cached = &cache[next_cache_slot];
+    next_cache_slot = (next_cache_slot + 1) % CACHE_SIZE;
+    free_cached(cached);
+    cached->key      = key;
+    cached->lease_id = response_header.request_id;
+    cached->expires  = sent + LEASE_DURATION;
+    cached->success  = success;
+    strbuf_reset(&cached->payload);
+    strbuf_append(&cached->payload, response.data, response.len);
 }
 
-//milliseconds
-double elapsed_time(clock_t start) {
-    return 1000.0 * (clock() - start) / (1.0 * CLOCKS_PER_SEC);
+void handle_revoke(uint32_t lease_id) {
+    revoked[next_revoked] = lease_id;
+    next_revoked = (next_revoked + 1) % N_REVOKED;
+    for (int i = 0; i < CACHE_SIZE; ++i) {
+        if (cache[i].key != NULL && cache[i].lease_id == lease_id) {
+            free_cached(cache + i);
+        }
+    }
 }
 
-// 300 milliseconds timeout
-int recv_nbytes(int n) {
-    clock_t start = clock();
-    int bytes_read;
-    while ((bytes_read = recv(con_fd, buf, n, 0)) == -1) {
-        if (errno == EAGAIN) {
-            if (elapsed_time(start) > 300.0) {
-                return 0;
-            }
-            //sleep_for(50);
-        } else {
-            puts("connection broke");
-            exit(1);
+void clear_cache() {
+    for (int i = 0; i < CACHE_SIZE; ++i) {
+        free_cached(cache + i);
+    }
+}
+
+void recv_message(int fd, struct msg_header* header, struct strbuf* payload) {
+    unsigned char header_buf[MSG_HEADER_SIZE];
+    recv_all(fd, header_buf, sizeof(header_buf));
+    decode_header(header_buf, header);
+    strbuf_reset(payload);
+    char chunk[CHUNK_SIZE];
+    for (uint32_t n_bytes_left = header->payload_len; n_bytes_left > 0; ) {
+        int n_bytes_cur = (n_bytes_left < sizeof(chunk) ? n_bytes_left : sizeof(chunk));
+        recv_all(fd, chunk, n_bytes_cur);
+        strbuf_append(payload, chunk, n_bytes_cur);
+        n_bytes_left -= n_bytes_cur;
+    }
+}
+
+// returns 1 on success; revocations that come first on the control connection are handled on the way
+int recv_response_from(int fd, struct msg_header* header, struct strbuf* payload) {
+    recv_message(fd, header, payload);
+    while (fd == con_fd && header->opcode == OP_REVOKE) {
+        handle_revoke(header->request_id);
+        recv_message(fd, header, payload);
+    }
+    if ((header->flags & RESPONSE_COMPRESSED) && header->opcode != OP_LOGIN) {
+        struct strbuf data;
+        strbuf_init(&data);
+        if (decompress_stream(payload->data, payload->len, &data, MAX_FILE_SIZE) == -1) {
+            header->status = STATUS_ERROR;
+            strbuf_reset(&data);
+            strbuf_appendf(&data, "corrupt compressed data\n");
         }
+        strbuf_free(payload);
+        *payload = data;
     }
-    buf[bytes_read] = '\0';
-    return bytes_read;
+    return header->status == STATUS_OK;
 }
 
-int get_response() {
-    return recv_nbytes(sizeof(buf) - 1);
+// handles the revocations that have arrived, only to be called when no response is due
+void poll_notices() {
+    struct pollfd pfd = { .fd = con_fd, .events = POLLIN };
+    struct msg_header header;
+    while (!use_shm && poll(&pfd, 1, 0) > 0) {
+        recv_message(con_fd, &header, &response);
+        if (header.opcode == OP_REVOKE) {
+            handle_revoke(header.request_id);
+        }
+    }
+}
+
+void send_request_with_flags(enum opcode opcode, uint16_t flags, const char* args) {
+    ++last_request_id;
+    send_header_to(con_fd, opcode, flags, last_request_id, strlen(args));
+    send_all(con_fd, args, strlen(args));
+}
+
+void send_request(enum opcode opcode, const char* args) {
+    send_request_with_flags(opcode, 0, args);
+}
+
+// reads the next response on the control connection into response_header and response, returns 1 on success
+int recv_response() {
+    return recv_response_from(con_fd, &response_header, &response);
 }
 
 int is_success() {
-    recv_nbytes(1);
-    return buf[0] == '1';
+    return recv_response();
 }
 
 int is_failure() {
     return !is_success();
 }
 
-void skip_succfail() {
-    is_success();
-}
-
 void print_response() {
-    while (get_response() > 0) {
-        printf("%s", buf);
-    }
+    fwrite(response.data, 1, response.len, stdout);
 }
 
-void discard_response() {
-    while (get_response() > 0) {}
+int get_cmd() {
+    if (fgets(buf, sizeof(buf), stdin) == NULL) {
+        return -1;
+    }
+    if (buf[strlen(buf) - 1] == '\n') {
+        buf[strlen(buf) - 1] = '\0';
+    }
+    return 0;
 }
 
 void print_prompt() {
     printf("%s$ ", work_path);
 }
 
-void change_dir() {
-    send_msg(buf);
-    if (is_success()) {
-        work_path[0] = '\0';
-        int len;
-        while ((len = get_response()) > 0) {
-            *strchrnul(buf, '\n') = '\0';
-            strcat(work_path, buf);
+void print_listing(int success, const struct strbuf* payload) {
+    if (!success) {
+        puts("error");
+    }
+    fwrite(payload->data, 1, payload->len, stdout);
+}
+
+// ls or readdir, answered from the cache if possible
+void list_cached(enum opcode opcode, const char* args) {
+    poll_notices();
+    char* key = make_cache_key(opcode, args);
+    struct cached_listing* cached = find_cached(key);
+    if (cached != NULL) {
+        free(key);
+        print_listing(cached->success, &cached->payload);
+        return;
+    }
+    time_t sent = time(NULL);
+    send_request_with_flags(opcode, REQUEST_LEASE, args);
+    int success = recv_response();
+    cache_listing(key, sent, success);
+    print_listing(success, &response);
+}
+
+// whatever else we send may change the tree
+int is_read_only(char** tokens) {
+    static const char* names[] = { "help", "pwd", "ls", "readdir", "cat", "read", "cd", "wait", "exit", "get", "du", "find", "stat" };
+    for (size_t i = 0; tokens[0] != NULL && i < sizeof(names) / sizeof(names[0]); ++i) {
+        if (strcmp(tokens[0], names[i]) == 0) {
+            return 1;
         }
+    }
+    return tokens[0] == NULL;
+}
+
+void change_dir(const char* args) {
+    send_request(OP_CD, args);
+    if (is_success()) {
+        *strchrnul(response.data, '\n') = '\0';
+        strcpy(work_path, response.data);
     } else {
         puts("error");
         print_response();
     }
 }
 
-int copy_from_local(const char* src_path) {
+// a file transfer on a data connection of its own, negotiated on the control connection;
+// it can run in the background while the control connection goes on with other commands
+struct transfer {
+    enum opcode      opcode;   // OP_UPLOAD or OP_DOWNLOAD
+    FILE*            local_fp; // read from or written to
+    off_t            size;     // of an upload
+    int              ranged;   // one of the ranges of a parallel transfer, which goes at this offset
+    off_t            offset;
+    char*            ticket;
+    struct strbuf    output;   // printed once the transfer is done
+    pthread_t        thread;
+    struct transfer* next;
+};
+
+// started with a trailing '&', in the order they were started
+struct transfer* background_head;
+struct transfer* background_tail;
+
+void* run_transfer(void* arg) {
+    struct transfer* transfer = arg;
+    int fd = connect_to_server();
+    send_header_to(fd, OP_ATTACH, (use_compression ? REQUEST_COMPRESS : 0), 1, strlen(transfer->ticket));
+    send_all(fd, transfer->ticket, strlen(transfer->ticket));
+
+    struct msg_header header;
+    struct strbuf payload;
+    strbuf_init(&payload);
+    if (transfer->opcode == OP_DOWNLOAD) {
+        if (recv_response_from(fd, &header, &payload)) {
+            if (transfer->ranged) {
+                pwrite(fileno(transfer->local_fp), payload.data, payload.len, transfer->offset);
+            } else {
+                fwrite(payload.data, 1, payload.len, transfer->local_fp);
+            }
+        } else {
+            strbuf_appendf(&transfer->output, "error\n");
+            strbuf_append(&transfer->output, payload.data, payload.len);
+        }
+    } else if (!transfer->ranged && !recv_response_from(fd, &header, &payload)) {
+        // refused before anything was sent; a range doesn't wait to be told to go ahead,
+        // it was all checked when the upload was split up
+        strbuf_append(&transfer->output, payload.data, payload.len);
+    } else if (use_compression) {
+        // compressed as a whole, which is no more than MAX_FILE_SIZE; sent as it is if that doesn't pay off
+        char* data = malloc(transfer->size + 1);
+        pread(fileno(transfer->local_fp), data, transfer->size, transfer->offset);
+        struct strbuf compressed;
+        strbuf_init(&compressed);
+        compress_stream(data, transfer->size, &compressed);
+        if (compressed.len < (size_t)transfer->size) {
+            send_header_to(fd, OP_DATA, REQUEST_COMPRESSED, 1, compressed.len);
+            send_all(fd, compressed.data, compressed.len);
+        } else {
+            send_header_to(fd, OP_DATA, 0, 1, transfer->size);
+            send_all(fd, data, transfer->size);
+        }
+        strbuf_free(&compressed);
+        free(data);
+    } else {
+        char* chunk = malloc(CHUNK_SIZE);
+        send_header_to(fd, OP_DATA, 0, 1, transfer->size);
+        // pread() since the ranges of a parallel upload share the file
+        for (off_t pos = 0; pos < transfer->size; pos += CHUNK_SIZE) {
+            int n_bytes_cur = (transfer->size - pos < CHUNK_SIZE ? transfer->size - pos : CHUNK_SIZE);
+            pread(fileno(transfer->local_fp), chunk, n_bytes_cur, transfer->offset + pos);
+            send_all(fd, chunk, n_bytes_cur);
+        }
+        free(chunk);
+        // the file is only linked into the directory once all of it has arrived
+        if (!recv_response_from(fd, &header, &payload)) {
+            strbuf_appendf(&transfer->output, "error\n");
+            strbuf_append(&transfer->output, payload.data, payload.len);
+        }
+    }
+    strbuf_free(&payload);
+    close(fd);
+    fclose(transfer->local_fp);
+    return NULL;
+}
+
+void finish_transfer(struct transfer* transfer) {
+    fwrite(transfer->output.data, 1, transfer->output.len, stdout);
+    strbuf_free(&transfer->output);
+    free(transfer->ticket);
+    free(transfer);
+}
+
+// the control connection has handed out a ticket for the transfer (the response to its request)
+void start_transfer(enum opcode opcode, FILE* local_fp, off_t size, int background) {
+    struct transfer* transfer = calloc(1, sizeof(struct transfer));
+    transfer->opcode   = opcode;
+    transfer->local_fp = local_fp;
+    transfer->size     = size;
+    transfer->ticket   = strdup(response.data);
+    strbuf_init(&transfer->output);
+    if (!background) {
+        run_transfer(transfer);
+        finish_transfer(transfer);
+        return;
+    }
+    pthread_create(&transfer->thread, NULL, run_transfer, transfer);
+    if (background_tail == NULL) {
+        background_head = transfer;
+    } else {
+        background_tail->next = transfer;
+    }
+    background_tail = transfer;
+}
+
+// the control connection has split the transfer into ranges (the response to its request),
+// each of them goes on a connection of its own at the same time
+void start_parallel_transfer(enum opcode opcode, int local_fd, int background) {
+    struct transfer* ranges[MAX_TRANSFER_STREAMS];
+    int n_ranges = 0;
+    for (char* line = response.data; line < response.data + response.len && n_ranges < MAX_TRANSFER_STREAMS; ) {
+        char* end = strchrnul(line, '\n');
+        *end = '\0';
+        long long offset, len;
+        int n_chars;
+        if (sscanf(line, "%lld %lld %n", &offset, &len, &n_chars) >= 2) {
+            struct transfer* transfer = calloc(1, sizeof(struct transfer));
+            transfer->opcode   = opcode;
+            // every range closes its own
+            transfer->local_fp = fdopen(dup(local_fd), (opcode == OP_UPLOAD ? "r" : "w"));
+            transfer->size     = len;
+            transfer->ranged   = 1;
+            transfer->offset   = offset;
+            transfer->ticket   = strdup(line + n_chars);
+            strbuf_init(&transfer->output);
+            ranges[n_ranges++] = transfer;
+        }
+        line = end + 1;
+    }
+    close(local_fd);
+
+    for (int i = 0; i < n_ranges; ++i) {
+        pthread_create(&ranges[i]->thread, NULL, run_transfer, ranges[i]);
+    }
+    for (int i = 0; i < n_ranges; ++i) {
+        if (!background) {
+            pthread_join(ranges[i]->thread, NULL);
+            finish_transfer(ranges[i]);
+            continue;
+        }
+        if (background_tail == NULL) {
+            background_head = ranges[i];
+        } else {
+            background_tail->next = ranges[i];
+        }
+        background_tail = ranges[i];
+    }
+}
+
+void wait_background_transfers() {
+    while (background_head != NULL) {
+        struct transfer* transfer = background_head;
+        background_head = transfer->next;
+        pthread_join(transfer->thread, NULL);
+        finish_transfer(transfer);
+    }
+    background_tail = NULL;
+}
+
+int copy_from_local(const char* src_path, const char* dest_path, int n_streams, int background) {
     int src_fd = open(src_path, O_RDONLY);
     if (src_fd == -1) {
         printf("%s: couldn't open\n", src_path);
@@ -155,50 +551,594 @@ int copy_from_local(const char* src_path) {
         return -1;
     }
 
-    send_msg(buf);
-    skip_succfail(); // sync
-    send_nbytes(&src_stat.st_size, sizeof(src_stat.st_size));
-
+    char args[MAX_REQUEST_PAYLOAD];
+    snprintf(args, sizeof(args), "%s %lld %d", dest_path, (long long)src_stat.st_size, n_streams);
+    send_request((n_streams > 1 ? OP_OPEN_PARALLEL_UPLOAD : OP_OPEN_UPLOAD), args);
     if (is_failure()) {
+        puts("error");
         print_response();
         close(src_fd);
         return -1;
     }
-
-    FILE* src_fp = fdopen(src_fd, "r");
-    char buf[MINIFS_BLOCK_SIZE + 1];
-    for (int n_bytes_left = src_stat.st_size; n_bytes_left > 0; n_bytes_left -= MINIFS_BLOCK_SIZE) {
-        int n_bytes_cur = (n_bytes_left < MINIFS_BLOCK_SIZE ? n_bytes_left : MINIFS_BLOCK_SIZE);
-        fread(buf, 1, n_bytes_cur, src_fp);
-        buf[n_bytes_cur] = '\0';
-        send_nbytes(buf, n_bytes_cur);
+    if (n_streams > 1) {
+        start_parallel_transfer(OP_UPLOAD, src_fd, background);
+    } else {
+        start_transfer(OP_UPLOAD, fdopen(src_fd, "r"), src_stat.st_size, background);
     }
-
-    fclose(src_fp);
     return 0;
 }
 
-int copy_to_local(const char* dest_path) {
+int copy_to_local(const char* src_path, const char* dest_path, int n_streams, int background) {
     FILE* dest_fp = fopen(dest_path, "w");
     if (dest_fp == NULL) {
         printf("%s: couldn't open or create\n", dest_path);
         return -1;
     }
-    send_msg(buf);
+    if (n_streams > 1) {
+        char args[MAX_REQUEST_PAYLOAD];
+        snprintf(args, sizeof(args), "%s %d", src_path, n_streams);
+        send_request(OP_OPEN_PARALLEL_DOWNLOAD, args);
+    } else {
+        send_request(OP_OPEN_DOWNLOAD, src_path);
+    }
     if (is_failure()) {
         puts("error");
         print_response();
         fclose(dest_fp);
         return -1;
     }
-    int len;
-    while ((len = get_response()) > 0) {
-        fwrite(buf, 1, len, dest_fp);
+    if (n_streams > 1) {
+        start_parallel_transfer(OP_DOWNLOAD, dup(fileno(dest_fp)), background);
+        fclose(dest_fp);
+    } else {
+        start_transfer(OP_DOWNLOAD, dest_fp, 0, background);
+    }
+    return 0;
+}
+
+static const char* batch_result_names[] = {
+    [BATCH_OK]      = "ok",
+    [BATCH_FAILED]  = "failed",
+    [BATCH_UNDONE]  = "undone",
+    [BATCH_SKIPPED] = "skipped"
+};
+
+// sends the lines of a local file as a single batch and reports the ones that didn't go through
+int run_batch(const char* path, int atomic) {
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        printf("%s: couldn't open\n", path);
+        return -1;
+    }
+    struct strbuf lines;
+    strbuf_init(&lines);
+    char chunk[CHUNK_SIZE];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        strbuf_append(&lines, chunk, n);
+    }
+    fclose(fp);
+    if (lines.len > MAX_BATCH_PAYLOAD) {
+        printf("%s: batch too large\n", path);
+        strbuf_free(&lines);
+        return -1;
+    }
+
+    ++last_request_id;
+    send_header_to(con_fd, OP_BATCH, (atomic ? REQUEST_ATOMIC : 0), last_request_id, lines.len);
+    send_all(con_fd, lines.data, lines.len);
+    int success = recv_response();
+    if (!success) {
+        puts("error");
+    }
+
+    // the server skips empty lines, so there's a result per non-empty one
+    int n_results[4] = { 0 };
+    size_t n_seen = 0;
+    char* line = lines.data;
+    for (int line_no = 1; line < lines.data + lines.len && n_seen < response.len; ++line_no) {
+        char* end = strchrnul(line, '\n');
+        int empty = (end == line);
+        *end = '\0';
+        if (!empty) {
+            unsigned char result = response.data[n_seen++];
+            if (result <= BATCH_SKIPPED) {
+                ++n_results[result];
+                if (result != BATCH_OK) {
+                    printf("line %d: %s: %s\n", line_no, batch_result_names[result], line);
+                }
+            }
+        }
+        line = end + 1;
+    }
+    printf("%d ok, %d failed, %d undone, %d skipped\n",
+           n_results[BATCH_OK], n_results[BATCH_FAILED], n_results[BATCH_UNDONE], n_results[BATCH_SKIPPED]);
+    strbuf_free(&lines);
+    return (success ? 0 : -1);
+}
+
+// pwrite-style, on the control connection: the server looks at the arguments before the data is sent
+int write_range(const char* path, const char* offset, const void* data, size_t size) {
+    char args[MAX_REQUEST_PAYLOAD];
+    snprintf(args, sizeof(args), "%s %s %zu", path, offset, size);
+    send_request(OP_WRITE, args);
+    if (is_failure()) {
+        puts("error");
+        print_response();
+        return -1;
+    }
+    send_header_to(con_fd, OP_DATA, 0, last_request_id, size);
+    send_all(con_fd, data, size);
+    if (is_failure()) {
+        puts("error");
+        print_response();
+        return -1;
     }
-    fclose(dest_fp);
     return 0;
 }
 
+int write_from_local(const char* src_path, const char* path, const char* offset) {
+    FILE* fp = fopen(src_path, "r");
+    if (fp == NULL) {
+        printf("%s: couldn't open\n", src_path);
+        return -1;
+    }
+    struct strbuf data;
+    strbuf_init(&data);
+    char chunk[CHUNK_SIZE];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        strbuf_append(&data, chunk, n);
+    }
+    fclose(fp);
+    int result = write_range(path, offset, data.data, data.len);
+    strbuf_free(&data);
+    return result;
+}
+
+// the shell commands that map directly onto a request, with the rest of the line as its arguments
+static const struct {
+    const char* name;
+    enum opcode opcode;
+} commands[] = {
+    { "help",     OP_HELP     },
+    { "pwd",      OP_PWD      },
+    { "ls",       OP_LS       },
+    { "readdir",  OP_READDIR  },
+    { "cp",       OP_COPY     },
+    { "rm",       OP_REMOVE   },
+    { "mv",       OP_MOVE     },
+    { "mkdir",    OP_MKDIR    },
+    { "touch",    OP_TOUCH    },
+    { "cat",      OP_CAT      },
+    { "read",     OP_READ     },
+    { "truncate", OP_TRUNCATE },
+    { "du",       OP_DU       },
+    { "find",     OP_FIND     },
+    { "stat",     OP_STAT     }
+};
+
+int find_opcode(const char* name) {
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); ++i) {
+        if (strcmp(commands[i].name, name) == 0) {
+            return commands[i].opcode;
+        }
+    }
+    return -1;
+}
+
+// the opcode of a command that can be sent as is, -1 for the ones handled specially
+int get_plain_opcode(char** tokens) {
+    if (tokens[0] == NULL) {
+        return -1;
+    }
+    if (strcmp(tokens[0], "cp") == 0 && tokens[1] != NULL
+        && (strcmp(tokens[1], "--from-local") == 0 || strcmp(tokens[1], "--to-local") == 0)) {
+        return -1;
+    }
+    return find_opcode(tokens[0]);
+}
+
+// a transfer line ending with '&' doesn't wait for the transfer to finish
+int is_background(char** tokens) {
+    int n = 0;
+    while (tokens[n] != NULL) {
+        ++n;
+    }
+    return (n > 0 && strcmp(tokens[n - 1], "&") == 0);
+}
+
+// everything after the command name
+const char* get_args(const char* cmd) {
+    cmd += strspn(cmd, " ");
+    cmd += strcspn(cmd, " ");
+    return cmd + strspn(cmd, " ");
+}
+
+// cp --from-local|--to-local [--streams N] src dest [&]
+void copy_local(char** tokens) {
+    int n_streams = 1;
+    char** operands = tokens + 2;
+    if (operands[0] != NULL && strcmp(operands[0], "--streams") == 0 && operands[1] != NULL) {
+        n_streams = atoi(operands[1]);
+        operands += 2;
+    }
+    if (operands[0] == NULL || operands[1] == NULL) {
+        puts("error");
+        puts("missing operand");
+    } else if (strcmp(tokens[1], "--from-local") == 0) {
+        copy_from_local(operands[0], operands[1], n_streams, is_background(tokens));
+    } else {
+        copy_to_local(operands[0], operands[1], n_streams, is_background(tokens));
+    }
+}
+
+// when commands come from a script, plain ones are sent without waiting for the previous responses.
+// the server may answer them in any order, the output is still printed in the order of the commands
+#define PIPELINE_DEPTH 64
+
+struct pending {
+    int           done;
+    int           success;
+    struct strbuf payload;
+    char*         cache_key; // of a listing sent for a lease
+    time_t        sent;
+} pending[PIPELINE_DEPTH]; // indexed by request id
+uint32_t oldest_pending_id;
+int n_pending;
+
+void recv_pending() {
+    int success = recv_response();
+    struct pending* p = &pending[response_header.request_id % PIPELINE_DEPTH];
+    p->done = 1;
+    p->success = success;
+    strbuf_reset(&p->payload);
+    strbuf_append(&p->payload, response.data, response.len);
+    if (p->cache_key != NULL) {
+        cache_listing(p->cache_key, p->sent, success);
+        p->cache_key = NULL;
+    }
+}
+
+void print_done_pending() {
+    while (n_pending > 0 && pending[oldest_pending_id % PIPELINE_DEPTH].done) {
+        struct pending* p = &pending[oldest_pending_id % PIPELINE_DEPTH];
+        print_prompt();
+        print_listing(p->success, &p->payload);
+        p->done = 0;
+        ++oldest_pending_id;
+        --n_pending;
+    }
+}
+
+void send_pipelined(enum opcode opcode, const char* args) {
+    char* key = NULL;
+    if (is_cacheable(opcode)) {
+        key = make_cache_key(opcode, args);
+        // with requests in flight, the listing might not reflect them yet
+        struct cached_listing* cached = NULL;
+        struct pollfd pfd = { .fd = con_fd, .events = POLLIN };
+        while (n_pending > 0 && poll(&pfd, 1, 0) > 0) {
+            recv_pending();
+            print_done_pending();
+        }
+        if (n_pending == 0) {
+            poll_notices();
+            cached = find_cached(key);
+        }
+        if (cached != NULL) {
+            free(key);
+            print_prompt();
+            print_listing(cached->success, &cached->payload);
+            return;
+        }
+    }
+    while (n_pending == PIPELINE_DEPTH) {
+        recv_pending();
+        print_done_pending();
+    }
+    send_request_with_flags(opcode, (key != NULL ? REQUEST_LEASE : 0), args);
+    struct pending* p = &pending[last_request_id % PIPELINE_DEPTH];
+    p->cache_key = key;
+    p->sent      = time(NULL);
+    if (n_pending++ == 0) {
+        oldest_pending_id = last_request_id;
+    }
+}
+
+void drain_pending() {
+    while (n_pending > 0) {
+        recv_pending();
+        print_done_pending();
+    }
+}
+
+// put and get: whole trees moved with up to PIPELINE_DEPTH requests in flight.
+// directories are created in order, since their contents need them; file uploads are sent
+// as REQUEST_UNORDERED OP_PUT right after, and the server runs them in parallel.
+// a get lists each directory as soon as it's found and downloads files as the listings come in
+struct bulk_item {
+    char*     local_path;
+    char*     remote_path;
+    int       is_dir;
+    long long size; // of an uploaded file, once it's read
+};
+
+// items not yet sent, in the order found
+struct bulk_item* bulk_queue;
+int bulk_queue_head;
+int bulk_queue_len;
+int bulk_queue_capacity;
+
+// requests in flight, indexed by request id
+struct {
+    int              busy;
+    struct bulk_item item;
+} bulk_in_flight[PIPELINE_DEPTH];
+int n_bulk_in_flight;
+
+struct {
+    int       n_files;
+    int       n_dirs;
+    int       n_failed;
+    long long n_bytes;
+} bulk_stats;
+
+char* join_path(const char* dir, const char* name) {
+    char* path = malloc(strlen(dir) + strlen(name) + 2);
+    sprintf(path, "%s%s%s", dir, (dir[strlen(dir) - 1] == '/' ? "" : "/"), name);
+    return path;
+}
+
+void push_bulk_item(char* local_path, char* remote_path, int is_dir) {
+    if (bulk_queue_len == bulk_queue_capacity) {
+        bulk_queue_capacity = (bulk_queue_capacity == 0 ? 64 : 2 * bulk_queue_capacity);
+        bulk_queue = realloc(bulk_queue, bulk_queue_capacity * sizeof(struct bulk_item));
+    }
+    bulk_queue[bulk_queue_len++] = (struct bulk_item){ local_path, remote_path, is_dir, 0 };
+}
+
+void free_bulk_item(struct bulk_item* item) {
+    free(item->local_path);
+    free(item->remote_path);
+}
+
+void bulk_failed(const struct bulk_item* item, const char* what) {
+    ++bulk_stats.n_failed;
+    printf("%s: %s", item->remote_path, what);
+    if (what[0] != '\0' && what[strlen(what) - 1] != '\n') {
+        puts("");
+    }
+}
+
+void send_bulk_request(const struct bulk_item* item, enum opcode opcode, uint16_t flags,
+                       const void* payload, size_t len) {
+    ++last_request_id;
+    send_header_to(con_fd, opcode, flags, last_request_id, len);
+    send_all(con_fd, payload, len);
+    bulk_in_flight[last_request_id % PIPELINE_DEPTH].busy = 1;
+    bulk_in_flight[last_request_id % PIPELINE_DEPTH].item = *item;
+    ++n_bulk_in_flight;
+}
+
+// sends what the item takes; returns 0 if there was nothing to send, the item is done then
+int send_put(struct bulk_item* item) {
+    if (item->is_dir) {
+        DIR* dir = opendir(item->local_path);
+        if (dir == NULL) {
+            bulk_failed(item, strerror(errno));
+            return 0;
+        }
+        for (struct dirent* entry; (entry = readdir(dir)) != NULL; ) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            char* local_path = join_path(item->local_path, entry->d_name);
+            struct stat st;
+            if (stat(local_path, &st) == -1 || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+                free(local_path);
+                continue;
+            }
+            push_bulk_item(local_path, join_path(item->remote_path, entry->d_name), S_ISDIR(st.st_mode));
+        }
+        closedir(dir);
+        send_bulk_request(item, OP_MKDIR, 0, item->remote_path, strlen(item->remote_path));
+        return 1;
+    }
+
+    FILE* fp = fopen(item->local_path, "rb");
+    if (fp == NULL) {
+        bulk_failed(item, strerror(errno));
+        return 0;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    rewind(fp);
+    if (size > MAX_FILE_SIZE) {
+        fclose(fp);
+        bulk_failed(item, "file too big");
+        return 0;
+    }
+    char* payload = malloc(strlen(item->remote_path) + 32 + size);
+    int len = sprintf(payload, "%s %ld\n", item->remote_path, size);
+    if (fread(payload + len, 1, size, fp) != (size_t)size) {
+        bulk_failed(item, "couldn't read the file");
+        free(payload);
+        fclose(fp);
+        return 0;
+    }
+    fclose(fp);
+    item->size = size;
+    struct strbuf compressed;
+    strbuf_init(&compressed);
+    if (use_compression) {
+        strbuf_append(&compressed, payload, len);
+        compress_stream(payload + len, size, &compressed);
+    }
+    if (use_compression && compressed.len < (size_t)(len + size)) {
+        send_bulk_request(item, OP_PUT, REQUEST_UNORDERED | REQUEST_COMPRESSED, compressed.data, compressed.len);
+    } else {
+        send_bulk_request(item, OP_PUT, REQUEST_UNORDERED, payload, len + size);
+    }
+    strbuf_free(&compressed);
+    free(payload);
+    return 1;
+}
+
+int send_get(struct bulk_item* item) {
+    if (!item->is_dir) {
+        send_bulk_request(item, OP_DOWNLOAD, (use_compression ? REQUEST_COMPRESS : 0),
+                          item->remote_path, strlen(item->remote_path));
+        return 1;
+    }
+    if (mkdir(item->local_path, 0755) == -1 && errno != EEXIST) {
+        bulk_failed(item, strerror(errno));
+        return 0;
+    }
+    char* args = malloc(strlen(item->remote_path) + 16);
+    sprintf(args, "--all --long %s", item->remote_path);
+    send_bulk_request(item, OP_LS, 0, args, strlen(args));
+    free(args);
+    return 1;
+}
+
+// the lines of ls --long: "t links owner size date time name"
+void queue_listing(const struct bulk_item* dir) {
+    strbuf_append(&response, "", 1);
+    char* save;
+    for (char* line = strtok_r(response.data, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+        char type;
+        char name[MINIFS_BLOCK_SIZE]; // longer than the line
+        if (sscanf(line, "%c %*d %*d %*d %*s %*s %s", &type, name) != 2
+            || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+        push_bulk_item(join_path(dir->local_path, name), join_path(dir->remote_path, name), type == 'd');
+    }
+}
+
+void recv_bulk_response() {
+    int success = recv_response();
+    struct bulk_item item = bulk_in_flight[response_header.request_id % PIPELINE_DEPTH].item;
+    bulk_in_flight[response_header.request_id % PIPELINE_DEPTH].busy = 0;
+    --n_bulk_in_flight;
+
+    strbuf_append(&response, "", 1);
+    if (!success) {
+        bulk_failed(&item, response.data);
+    } else if (response_header.opcode == OP_LS) {
+        queue_listing(&item);
+        ++bulk_stats.n_dirs;
+    } else if (response_header.opcode == OP_DOWNLOAD) {
+        FILE* fp = fopen(item.local_path, "wb");
+        if (fp == NULL || fwrite(response.data, 1, response.len - 1, fp) != response.len - 1) {
+            bulk_failed(&item, strerror(errno));
+        } else {
+            ++bulk_stats.n_files;
+            bulk_stats.n_bytes += response.len - 1;
+        }
+        if (fp != NULL) {
+            fclose(fp);
+        }
+    } else if (item.is_dir) {
+        ++bulk_stats.n_dirs;
+    } else {
+        ++bulk_stats.n_files;
+        bulk_stats.n_bytes += item.size;
+    }
+    free_bulk_item(&item);
+}
+
+// moves the tree rooted at the given item, then prints how it went
+void run_bulk(char* local_path, char* remote_path, int is_dir, int (*send_item)(struct bulk_item*)) {
+    memset(&bulk_stats, 0, sizeof(bulk_stats));
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    push_bulk_item(local_path, remote_path, is_dir);
+    while (bulk_queue_head < bulk_queue_len || n_bulk_in_flight > 0) {
+        if (bulk_queue_head == bulk_queue_len || bulk_in_flight[(last_request_id + 1) % PIPELINE_DEPTH].busy) {
+            recv_bulk_response();
+            continue;
+        }
+        struct bulk_item item = bulk_queue[bulk_queue_head++];
+        if (!send_item(&item)) {
+            free_bulk_item(&item);
+        }
+    }
+    bulk_queue_head = bulk_queue_len = 0;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%d files, %d directories, %lld bytes in %.3f s (%.0f files/s, %.2f MiB/s)",
+           bulk_stats.n_files, bulk_stats.n_dirs, bulk_stats.n_bytes, seconds,
+           bulk_stats.n_files / seconds, bulk_stats.n_bytes / seconds / (1 << 20));
+    if (bulk_stats.n_failed > 0) {
+        printf(", %d failed", bulk_stats.n_failed);
+    }
+    puts("");
+}
+
+// put [-r] local dest, get [-r] src local
+void copy_tree(char** tokens) {
+    int recursive = (tokens[1] != NULL && strcmp(tokens[1], "-r") == 0);
+    char** operands = tokens + 1 + recursive;
+    if (operands[0] == NULL || operands[1] == NULL) {
+        puts("error");
+        puts("missing operand");
+        return;
+    }
+    int put = (strcmp(tokens[0], "put") == 0);
+    run_bulk(strdup(operands[put ? 0 : 1]), strdup(operands[put ? 1 : 0]), recursive, put ? send_put : send_get);
+}
+
+// moves the control connection to shared memory, the server passes its fds along with the response;
+// if that doesn't work out, the session simply stays on the socket
+void open_shm() {
+    send_request(OP_OPEN_SHM, "");
+    unsigned char header_buf[MSG_HEADER_SIZE];
+    char control[CMSG_SPACE(SHM_N_FDS * sizeof(int))];
+    struct iovec iov = { .iov_base = header_buf, .iov_len = sizeof(header_buf) };
+    struct msghdr msg = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = control,
+        .msg_controllen = sizeof(control)
+    };
+    ssize_t received;
+    do {
+        received = recvmsg(con_fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+    if (received <= 0) {
+        puts("connection broke");
+        exit(1);
+    }
+    recv_all(con_fd, header_buf + received, sizeof(header_buf) - received);
+    decode_header(header_buf, &response_header);
+    strbuf_reset(&response);
+    if (response_header.payload_len > 0) {
+        char* payload = malloc(response_header.payload_len);
+        recv_all(con_fd, payload, response_header.payload_len);
+        strbuf_append(&response, payload, response_header.payload_len);
+        free(payload);
+    }
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (response_header.status != STATUS_OK || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(SHM_N_FDS * sizeof(int))) {
+        puts("couldn't switch to shared memory");
+        print_response();
+        return;
+    }
+    int fds[SHM_N_FDS];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    // the server closes its end of the socket when it's gone
+    use_shm = (shm_attach(&shm, fds, 0, con_fd) == 0);
+    close(fds[SHM_MEM_FD]);
+    if (!use_shm) {
+        puts("couldn't switch to shared memory");
+    }
+}
+
 void get_user_id() {
     while (1) {
         printf("user id: ");
@@ -213,7 +1153,7 @@ void get_user_id() {
 
 void handle_sigint(int signum) {
     if (con_fd != -1) {
-        send_msg("exit");
+        send_request(OP_EXIT, "");
     }
     puts("");
     exit(0);
@@ -231,33 +1171,108 @@ int main(int argc, char** argv) {
     struct sigaction action_int;
     setup_handler(SIGINT, &action_int, handle_sigint);
 
-    const char* ip = (argc >= 2 ? argv[1] : "127.0.0.1");
-    const int port = (argc >= 3 ? atoi(argv[2]) : 8080);
+    // client [ip [port]] or client local-socket-path [--shm]
+    if (argc >= 2 && strchr(argv[1], '/') != NULL) {
+        local_path = argv[1];
+    } else {
+        server_ip   = (argc >= 2 ? argv[1] : "127.0.0.1");
+        server_port = (argc >= 3 ? atoi(argv[2]) : 8080);
+    }
+    int want_shm = (local_path != NULL && argc >= 3 && strcmp(argv[2], "--shm") == 0);
 
     get_user_id();
-    create_connection(ip, port);
+    con_fd = connect_to_server();
     strcpy(work_path, "/");
-    send_msg(buf); // user id
-    skip_succfail();
+    strbuf_init(&response);
+    for (int i = 0; i < PIPELINE_DEPTH; ++i) {
+        strbuf_init(&pending[i].payload);
+    }
+    for (int i = 0; i < CACHE_SIZE; ++i) {
+        strbuf_init(&cache[i].payload);
+    }
+    // compression only pays off over the network
+    send_request_with_flags(OP_LOGIN, (local_path == NULL ? REQUEST_COMPRESS : 0), buf); // user id
+    recv_response();
+    use_compression = (response_header.flags & RESPONSE_COMPRESSED) != 0;
+    if (want_shm) {
+        open_shm();
+    }
 
+    int pipelined = !isatty(STDIN_FILENO);
     while (1) {
-        print_prompt();
-        get_cmd();
+        if (!pipelined) {
+            print_prompt();
+        }
+        if (get_cmd() == -1) {
+            drain_pending();
+            wait_background_transfers();
+            send_request(OP_EXIT, "");
+            break;
+        }
 
         char** tokens = split_str(buf, " ");
+        if (!is_read_only(tokens)) {
+            clear_cache();
+        }
+        if (pipelined && get_plain_opcode(tokens) != -1) {
+            send_pipelined(get_plain_opcode(tokens), get_args(buf));
+            free_tokens(tokens);
+            continue;
+        }
+        if (pipelined) {
+            drain_pending();
+            print_prompt();
+        }
         // some special cases
-        // if none of these, then we simply send data and print response
-        if (strcmp(tokens[0], "exit") == 0) {
+        // if none of these, then we simply send the request and print response
+        if (tokens[0] == NULL) {
+            free_tokens(tokens);
+            continue;
+        } else if (strcmp(tokens[0], "exit") == 0) {
+            wait_background_transfers();
+            send_request(OP_EXIT, "");
             free_tokens(tokens);
             break;
         } else if (strcmp(tokens[0], "cd") == 0) {
-            change_dir();
-        } else if (strcmp(tokens[0], "cp") == 0 && strcmp(tokens[1], "--from-local") == 0) {
-            copy_from_local(tokens[2]);
-        } else if (strcmp(tokens[0], "cp") == 0 && strcmp(tokens[1], "--to-local") == 0) {
-            copy_to_local(tokens[3]);
+            change_dir(get_args(buf));
+        } else if (strcmp(tokens[0], "wait") == 0) {
+            wait_background_transfers();
+        } else if (strcmp(tokens[0], "write") == 0 && tokens[1] != NULL && strcmp(tokens[1], "--from-local") == 0) {
+            if (tokens[2] == NULL || tokens[3] == NULL || tokens[4] == NULL) {
+                puts("error");
+                puts("missing operand");
+            } else {
+                write_from_local(tokens[2], tokens[3], tokens[4]);
+            }
+        } else if (strcmp(tokens[0], "write") == 0) {
+            if (tokens[1] == NULL || tokens[2] == NULL) {
+                puts("error");
+                puts("missing operand");
+            } else {
+                // the text is the rest of the line, spaces and all
+                const char* text = get_args(get_args(get_args(buf)));
+                write_range(tokens[1], tokens[2], text, strlen(text));
+            }
+        } else if (strcmp(tokens[0], "put") == 0 || strcmp(tokens[0], "get") == 0) {
+            copy_tree(tokens);
+        } else if (strcmp(tokens[0], "batch") == 0) {
+            int atomic = (tokens[1] != NULL && strcmp(tokens[1], "--atomic") == 0);
+            if (tokens[1 + atomic] == NULL) {
+                puts("error");
+                puts("missing operand");
+            } else {
+                run_batch(tokens[1 + atomic], atomic);
+            }
+        } else if (strcmp(tokens[0], "cp") == 0 && tokens[1] != NULL
+                   && (strcmp(tokens[1], "--from-local") == 0 || strcmp(tokens[1], "--to-local") == 0)) {
+            copy_local(tokens);
+        } else if (find_opcode(tokens[0]) == -1) {
+            puts("error");
+            puts("unknown command; type 'help' for help");
+        } else if (is_cacheable(find_opcode(tokens[0]))) {
+            list_cached(find_opcode(tokens[0]), get_args(buf));
         } else {
-            send_msg(buf);
+            send_request(find_opcode(tokens[0]), get_args(buf));
             if (is_failure()) {
                 puts("error");
             }
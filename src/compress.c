@@ -0,0 +1,213 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "compress.h"
+
+// the encoding is a sequence of: a token byte (literal count in the high nibble, match length minus
+// MIN_MATCH in the low one, 15 meaning that more bytes of 255 or less follow), the literals,
+// a 16-bit little-endian offset back into what's been decoded, and the rest of the match length.
+// the last sequence has literals only
+#define MIN_MATCH  4
+#define HASH_BITS  12
+#define MAX_OFFSET 0xffff
+
+static uint32_t hash4(const unsigned char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// the extra bytes of a length that didn't fit into its nibble
+static int put_length(unsigned char* out, int pos, int cap, int len) {
+    for (; len >= 255; len -= 255) {
+        if (pos == cap) {
+            return -1;
+        }
+        out[pos++] = 255;
+    }
+    if (pos == cap) {
+        return -1;
+    }
+    out[pos++] = len;
+    return pos;
+}
+
+static int put_sequence(unsigned char* out, int pos, int cap, const unsigned char* literals, int n_literals,
+                        int offset, int match_len) {
+    if (pos == cap) {
+        return -1;
+    }
+    int match_code = (offset == 0 ? 0 : match_len - MIN_MATCH);
+    out[pos++] = (n_literals < 15 ? n_literals : 15) << 4 | (match_code < 15 ? match_code : 15);
+    if (n_literals >= 15 && (pos = put_length(out, pos, cap, n_literals - 15)) == -1) {
+        return -1;
+    }
+    if (cap - pos < n_literals) {
+        return -1;
+    }
+    memcpy(out + pos, literals, n_literals);
+    pos += n_literals;
+    if (offset == 0) {
+        return pos;
+    }
+    if (cap - pos < 2) {
+        return -1;
+    }
+    out[pos++] = offset & 0xff;
+    out[pos++] = offset >> 8;
+    if (match_code >= 15 && (pos = put_length(out, pos, cap, match_code - 15)) == -1) {
+        return -1;
+    }
+    return pos;
+}
+
+// returns the encoded length, -1 as soon as it would exceed cap
+static int lz_compress(const unsigned char* in, int len, unsigned char* out, int cap) {
+    int table[1 << HASH_BITS];
+    memset(table, -1, sizeof(table));
+    int pos = 0, anchor = 0, out_pos = 0;
+    int n_misses = 0;
+    while (pos + MIN_MATCH <= len && out_pos != -1) {
+        uint32_t hash = hash4(in + pos);
+        int candidate = table[hash];
+        table[hash] = pos;
+        if (candidate == -1 || pos - candidate > MAX_OFFSET || memcmp(in + candidate, in + pos, MIN_MATCH) != 0) {
+            // the longer nothing matches, the bigger the steps over the data
+            pos += 1 + (n_misses++ >> 5);
+            continue;
+        }
+        n_misses = 0;
+        int match_len = MIN_MATCH;
+        while (pos + match_len < len && in[candidate + match_len] == in[pos + match_len]) {
+            ++match_len;
+        }
+        out_pos = put_sequence(out, out_pos, cap, in + anchor, pos - anchor, pos - candidate, match_len);
+        pos += match_len;
+        anchor = pos;
+    }
+    if (out_pos == -1) {
+        return -1;
+    }
+    return put_sequence(out, out_pos, cap, in + anchor, len - anchor, 0, 0);
+}
+
+// the extra bytes of a length; -1 if the input ends first
+static int get_length(const unsigned char* in, int len, int* pos, int* value) {
+    unsigned char byte;
+    do {
+        if (*pos == len) {
+            return -1;
+        }
+        byte = in[(*pos)++];
+        *value += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+// decodes exactly out_len bytes, -1 if the input doesn't hold that
+static int lz_decompress(const unsigned char* in, int len, unsigned char* out, int out_len) {
+    int pos = 0, out_pos = 0;
+    while (pos < len) {
+        unsigned char token = in[pos++];
+        int n_literals = token >> 4;
+        if (n_literals == 15 && get_length(in, len, &pos, &n_literals) == -1) {
+            return -1;
+        }
+        if (len - pos < n_literals || out_len - out_pos < n_literals) {
+            return -1;
+        }
+        memcpy(out + out_pos, in + pos, n_literals);
+        pos += n_literals;
+        out_pos += n_literals;
+        if (pos == len) {
+            break;
+        }
+
+        if (len - pos < 2) {
+            return -1;
+        }
+        int offset = in[pos] | in[pos + 1] << 8;
+        pos += 2;
+        int match_len = token & 15;
+        if (match_len == 15 && get_length(in, len, &pos, &match_len) == -1) {
+            return -1;
+        }
+        match_len += MIN_MATCH;
+        if (offset == 0 || offset > out_pos || out_len - out_pos < match_len) {
+            return -1;
+        }
+        if (offset >= match_len) {
+            memcpy(out + out_pos, out + out_pos - offset, match_len);
+            out_pos += match_len;
+        } else {
+            // byte by byte, the match overlaps what it produces
+            for (int i = 0; i < match_len; ++i, ++out_pos) {
+                out[out_pos] = out[out_pos - offset];
+            }
+        }
+    }
+    return (out_pos == out_len ? 0 : -1);
+}
+
+size_t compress_bound(size_t len) {
+    return len + (len / COMPRESS_CHUNK_SIZE + 1) * 2 * sizeof(uint32_t);
+}
+
+static void put_chunk_header(struct strbuf* out, uint32_t raw_len, uint32_t encoded_len) {
+    uint32_t header[2] = { htonl(raw_len), htonl(encoded_len) };
+    strbuf_append(out, header, sizeof(header));
+}
+
+void compress_stream(const void* data, size_t len, struct strbuf* out) {
+    unsigned char* encoded = malloc(COMPRESS_CHUNK_SIZE);
+    for (const unsigned char* chunk = data; len > 0; ) {
+        int raw_len = (len < COMPRESS_CHUNK_SIZE ? len : COMPRESS_CHUNK_SIZE);
+        int encoded_len = lz_compress(chunk, raw_len, encoded, raw_len - raw_len / 8);
+        if (encoded_len == -1) {
+            put_chunk_header(out, raw_len, raw_len | COMPRESS_STORED);
+            strbuf_append(out, chunk, raw_len);
+        } else {
+            put_chunk_header(out, raw_len, encoded_len);
+            strbuf_append(out, encoded, encoded_len);
+        }
+        chunk += raw_len;
+        len -= raw_len;
+    }
+    free(encoded);
+}
+
+int decompress_stream(const void* data, size_t len, struct strbuf* out, size_t max_len) {
+    unsigned char* decoded = malloc(COMPRESS_CHUNK_SIZE);
+    size_t n_decoded = 0;
+    int result = 0;
+    for (const unsigned char* chunk = data; len > 0 && result == 0; ) {
+        uint32_t header[2];
+        if (len < sizeof(header)) {
+            result = -1;
+            break;
+        }
+        memcpy(header, chunk, sizeof(header));
+        uint32_t raw_len = ntohl(header[0]);
+        uint32_t encoded_len = ntohl(header[1]) & ~COMPRESS_STORED;
+        int stored = (ntohl(header[1]) & COMPRESS_STORED) != 0;
+        chunk += sizeof(header);
+        len -= sizeof(header);
+        if (raw_len > COMPRESS_CHUNK_SIZE || encoded_len > len || raw_len > max_len - n_decoded
+            || (stored && encoded_len != raw_len)) {
+            result = -1;
+            break;
+        }
+        if (stored) {
+            strbuf_append(out, chunk, raw_len);
+        } else if ((result = lz_decompress(chunk, encoded_len, decoded, raw_len)) == 0) {
+            strbuf_append(out, decoded, raw_len);
+        }
+        chunk += encoded_len;
+        len -= encoded_len;
+        n_decoded += raw_len;
+    }
+    free(decoded);
+    return result;
+}
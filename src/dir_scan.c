@@ -0,0 +1,214 @@
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "dir_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIR_SCAN_X86
+#endif
+
+_Static_assert(sizeof(struct entry) == 32, "kernels assume 32-byte entries");
+_Static_assert(ENTRIES_PER_BLOCK == 32, "kernels assume one uint32_t mask bit per entry of a block");
+
+// the byte pattern a matching entry must have, and which of its bytes are compared:
+// the inode id is ignored, the filename is compared up to and including its null terminator
+struct name_key {
+    char     bytes[sizeof(struct entry)];
+    uint32_t care;
+};
+
+static int make_name_key(struct name_key* key, const char* filename) {
+    size_t len = strlen(filename);
+    if (len >= FILENAME_LEN) {
+        return -1;
+    }
+    memset(key->bytes, 0, sizeof(key->bytes));
+    memcpy(key->bytes + offsetof(struct entry, filename), filename, len + 1);
+    key->care = (uint32_t)((1ull << (len + 1)) - 1) << offsetof(struct entry, filename);
+    return 0;
+}
+
+static int always_supported() {
+    return 1;
+}
+
+static uint32_t match_name_scalar(const struct entry* block, const char* filename) {
+    if (strlen(filename) >= FILENAME_LEN) {
+        return 0;
+    }
+    uint32_t mask = 0;
+    for (int i = 0; i < ENTRIES_PER_BLOCK; ++i) {
+        if (0 <= block[i].inode_id && block[i].inode_id < N_INODES && strncmp(block[i].filename, filename, FILENAME_LEN) == 0) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+}
+
+static uint32_t match_inode_scalar(const struct entry* block, int inode_id) {
+    uint32_t mask = 0;
+    for (int i = 0; i < ENTRIES_PER_BLOCK; ++i) {
+        if (block[i].inode_id == inode_id) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+}
+
+#ifdef DIR_SCAN_X86
+
+static int sse2_supported() {
+    return __builtin_cpu_supports("sse2");
+}
+
+// gathers the inode ids of entries i..i+3 into one register
+__attribute__((target("sse2")))
+static __m128i load_ids_sse2(const struct entry* block, int i) {
+    __m128i a0 = _mm_loadu_si128((const __m128i*)(block + i));
+    __m128i a1 = _mm_loadu_si128((const __m128i*)(block + i + 1));
+    __m128i a2 = _mm_loadu_si128((const __m128i*)(block + i + 2));
+    __m128i a3 = _mm_loadu_si128((const __m128i*)(block + i + 3));
+    return _mm_unpacklo_epi64(_mm_unpacklo_epi32(a0, a1), _mm_unpacklo_epi32(a2, a3));
+}
+
+__attribute__((target("sse2")))
+static uint32_t valid_ids_sse2(const struct entry* block) {
+    const __m128i lo = _mm_set1_epi32(-1);
+    const __m128i hi = _mm_set1_epi32(N_INODES);
+    uint32_t mask = 0;
+    for (int i = 0; i < ENTRIES_PER_BLOCK; i += 4) {
+        __m128i ids = load_ids_sse2(block, i);
+        __m128i valid = _mm_and_si128(_mm_cmpgt_epi32(ids, lo), _mm_cmplt_epi32(ids, hi));
+        mask |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(valid)) << i;
+    }
+    return mask;
+}
+
+__attribute__((target("sse2")))
+static uint32_t match_name_sse2(const struct entry* block, const char* filename) {
+    struct name_key key;
+    if (make_name_key(&key, filename) == -1) {
+        return 0;
+    }
+    const __m128i key_lo = _mm_loadu_si128((const __m128i*)key.bytes);
+    const __m128i key_hi = _mm_loadu_si128((const __m128i*)(key.bytes + 16));
+    uint32_t mask = 0;
+    for (int i = 0; i < ENTRIES_PER_BLOCK; ++i) {
+        const __m128i* e = (const __m128i*)(block + i);
+        uint32_t eq = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(e), key_lo))
+                    | (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(e + 1), key_hi)) << 16;
+        mask |= (uint32_t)((eq & key.care) == key.care) << i;
+    }
+    return mask & valid_ids_sse2(block);
+}
+
+__attribute__((target("sse2")))
+static uint32_t match_inode_sse2(const struct entry* block, int inode_id) {
+    const __m128i target = _mm_set1_epi32(inode_id);
+    uint32_t mask = 0;
+    for (int i = 0; i < ENTRIES_PER_BLOCK; i += 4) {
+        __m128i eq = _mm_cmpeq_epi32(load_ids_sse2(block, i), target);
+        mask |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(eq)) << i;
+    }
+    return mask;
+}
+
+static int avx2_supported() {
+    return __builtin_cpu_supports("avx2");
+}
+
+// offsets of the inode ids of 8 consecutive entries, in ints
+#define AVX2_ID_STRIDE ((int)(sizeof(struct entry) / sizeof(int)))
+
+__attribute__((target("avx2")))
+static __m256i load_ids_avx2(const struct entry* block, int i) {
+    const __m256i idx = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(AVX2_ID_STRIDE));
+    return _mm256_i32gather_epi32((const int*)(block + i), idx, sizeof(int));
+}
+
+__attribute__((target("avx2")))
+static uint32_t valid_ids_avx2(const struct entry* block) {
+    const __m256i lo = _mm256_set1_epi32(-1);
+    const __m256i hi = _mm256_set1_epi32(N_INODES);
+    uint32_t mask = 0;
+    for (int i = 0; i < ENTRIES_PER_BLOCK; i += 8) {
+        __m256i ids = load_ids_avx2(block, i);
+        __m256i valid = _mm256_and_si256(_mm256_cmpgt_epi32(ids, lo), _mm256_cmpgt_epi32(hi, ids));
+        mask |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(valid)) << i;
+    }
+    return mask;
+}
+
+__attribute__((target("avx2")))
+static uint32_t match_name_avx2(const struct entry* block, const char* filename) {
+    struct name_key key;
+    if (make_name_key(&key, filename) == -1) {
+        return 0;
+    }
+    const __m256i key_vec = _mm256_loadu_si256((const __m256i*)key.bytes);
+    uint32_t mask = 0;
+    for (int i = 0; i < ENTRIES_PER_BLOCK; ++i) {
+        __m256i e = _mm256_loadu_si256((const __m256i*)(block + i));
+        uint32_t eq = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(e, key_vec));
+        mask |= (uint32_t)((eq & key.care) == key.care) << i;
+    }
+    return mask & valid_ids_avx2(block);
+}
+
+__attribute__((target("avx2")))
+static uint32_t match_inode_avx2(const struct entry* block, int inode_id) {
+    const __m256i target = _mm256_set1_epi32(inode_id);
+    uint32_t mask = 0;
+    for (int i = 0; i < ENTRIES_PER_BLOCK; i += 8) {
+        __m256i eq = _mm256_cmpeq_epi32(load_ids_avx2(block, i), target);
+        mask |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(eq)) << i;
+    }
+    return mask;
+}
+
+#endif // DIR_SCAN_X86
+
+const struct dir_scan_kernels dir_scan_variants[] = {
+    { "scalar", always_supported, match_name_scalar, match_inode_scalar },
+#ifdef DIR_SCAN_X86
+    { "sse2",   sse2_supported,   match_name_sse2,   match_inode_sse2   },
+    { "avx2",   avx2_supported,   match_name_avx2,   match_inode_avx2   },
+#endif
+};
+
+const int n_dir_scan_variants = sizeof(dir_scan_variants) / sizeof(dir_scan_variants[0]);
+
+static const struct dir_scan_kernels* best_kernels;
+static pthread_once_t best_kernels_once = PTHREAD_ONCE_INIT;
+
+static void select_kernels() {
+#ifdef DIR_SCAN_X86
+    __builtin_cpu_init();
+#endif
+    // variants are listed from the most portable to the fastest
+    best_kernels = dir_scan_variants;
+    for (int i = 1; i < n_dir_scan_variants; ++i) {
+        if (dir_scan_variants[i].supported()) {
+            best_kernels = dir_scan_variants + i;
+        }
+    }
+}
+
+static const struct dir_scan_kernels* get_kernels() {
+    pthread_once(&best_kernels_once, select_kernels);
+    return best_kernels;
+}
+
+uint32_t dir_scan_name(const void* block, const char* filename) {
+    return get_kernels()->match_name(block, filename);
+}
+
+uint32_t dir_scan_inode(const void* block, int inode_id) {
+    return get_kernels()->match_inode(block, inode_id);
+}
+
+const char* dir_scan_kernel_name() {
+    return get_kernels()->name;
+}
@@ -0,0 +1,121 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "epoch.h"
+
+// one slot per thread that has ever entered a section, padded to its own cache line
+// so that readers never write to a line shared with another thread
+struct epoch_record {
+    _Atomic unsigned long epoch;
+    _Atomic int           active;
+    _Atomic int           in_use;
+} __attribute__((aligned(64)));
+
+struct retired {
+    void*           ptr;
+    unsigned long   epoch;
+    struct retired* next;
+};
+
+static _Atomic unsigned long global_epoch = 1;
+static struct epoch_record records[MAX_EPOCH_THREADS];
+// records past this one have never been used, so scans can stop here
+static _Atomic int records_high_water;
+
+static pthread_mutex_t retired_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct retired* retired_list;
+
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+
+static _Thread_local struct epoch_record* record;
+static _Thread_local int depth;
+
+static void release_record(void* rec) {
+    atomic_store(&((struct epoch_record*)rec)->active, 0);
+    atomic_store(&((struct epoch_record*)rec)->in_use, 0);
+}
+
+static void create_record_key() {
+    pthread_key_create(&record_key, release_record);
+}
+
+static struct epoch_record* acquire_record() {
+    pthread_once(&record_key_once, create_record_key);
+    while (1) {
+        for (int i = 0; i < MAX_EPOCH_THREADS; ++i) {
+            int expected = 0;
+            if (atomic_load_explicit(&records[i].in_use, memory_order_relaxed) == 0
+                    && atomic_compare_exchange_strong(&records[i].in_use, &expected, 1)) {
+                pthread_setspecific(record_key, records + i);
+                int high_water = atomic_load(&records_high_water);
+                while (high_water < i + 1 && !atomic_compare_exchange_weak(&records_high_water, &high_water, i + 1)) {}
+                return records + i;
+            }
+        }
+        // more threads than slots: wait for one of them to exit
+        sched_yield();
+    }
+}
+
+void epoch_enter() {
+    if (depth++ > 0) {
+        return;
+    }
+    if (record == NULL) {
+        record = acquire_record();
+    }
+    atomic_store(&record->epoch, atomic_load(&global_epoch));
+    atomic_store(&record->active, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epoch_exit() {
+    if (--depth > 0) {
+        return;
+    }
+    atomic_store_explicit(&record->active, 0, memory_order_release);
+}
+
+// the epoch can move on once every reader inside a section has observed the current one
+static void try_advance(unsigned long epoch) {
+    int n_records = atomic_load(&records_high_water);
+    for (int i = 0; i < n_records; ++i) {
+        if (atomic_load(&records[i].in_use) && atomic_load(&records[i].active)
+                && atomic_load(&records[i].epoch) != epoch) {
+            return;
+        }
+    }
+    atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1);
+}
+
+void epoch_retire(void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    struct retired* node = malloc(sizeof(struct retired));
+    node->ptr = ptr;
+    node->epoch = atomic_load(&global_epoch);
+
+    pthread_mutex_lock(&retired_mutex);
+    node->next = retired_list;
+    retired_list = node;
+
+    try_advance(atomic_load(&global_epoch));
+    // readers that saw an object retired in epoch e entered in epoch e or earlier,
+    // and the global epoch can't get two steps past theirs while they're inside
+    unsigned long safe_epoch = atomic_load(&global_epoch);
+    for (struct retired** cur = &retired_list; *cur != NULL;) {
+        if ((*cur)->epoch + 2 <= safe_epoch) {
+            struct retired* old = *cur;
+            *cur = old->next;
+            free(old->ptr);
+            free(old);
+        } else {
+            cur = &(*cur)->next;
+        }
+    }
+    pthread_mutex_unlock(&retired_mutex);
+}
@@ -1,12 +1,26 @@
 #include <assert.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "inode.h"
 #include "disk_io.h"
 #include "block.h"
-#include "bit_util.h"
 #include "str_util.h"
+#include "dir_scan.h"
+#include "lock.h"
+#include "alloc_bitmap.h"
+#include "epoch.h"
+#include "meta_cache.h"
+#include "lease.h"
+
+static struct alloc_bitmap inode_bitmap;
+
+// what the other threads go by while one of them holds the bitmap, see hold_inode_bitmap()
+static _Atomic uint64_t held_inode_words[(N_INODES + ALLOC_GROUP_SIZE - 1) / ALLOC_GROUP_SIZE];
+static atomic_int inode_bitmap_held;
+static _Thread_local int holding_inode_bitmap;
 
 int get_inode_offset(int inode_id) {
     assert(is_correct_inode_id(inode_id));
@@ -21,9 +35,11 @@ int is_allocated_inode_id(int inode_id) {
     if (!is_correct_inode_id(inode_id)) {
         return 0;
     }
-    char byte;
-    read_data(&byte, 1, MINIFS_BLOCK_SIZE * 2 + inode_id / 8);
-    return !is_one(byte, inode_id % 8);
+    if (atomic_load(&inode_bitmap_held) && !holding_inode_bitmap) {
+        uint64_t word = atomic_load(held_inode_words + inode_id / ALLOC_GROUP_SIZE);
+        return !((word >> (inode_id % ALLOC_GROUP_SIZE)) & 1);
+    }
+    return !alloc_bitmap_is_free(&inode_bitmap, inode_id);
 }
 
 int is_dir(int inode_id) {
@@ -46,51 +62,126 @@ int is_regular_file(int inode_id) {
 
 void read_inode(struct inode* inode, int inode_id) {
     assert(is_correct_inode_id(inode_id));
-    read_data(inode, sizeof(struct inode), get_inode_offset(inode_id));
+    if (cached_read_inode(inode, inode_id) == -1) {
+        read_data(inode, sizeof(struct inode), get_inode_offset(inode_id));
+    }
+}
+
+static int compare_ints(const void* a, const void* b) {
+    return *(const int*)a - *(const int*)b;
+}
+
+void read_inodes(const int* inode_ids, int n, struct inode* inodes) {
+    int sorted_ids[N_INODES];
+    struct inode sorted_inodes[N_INODES];
+    char found[N_INODES];
+    assert(n <= N_INODES);
+    // duplicates are read once
+    int n_sorted = 0;
+    memcpy(sorted_ids, inode_ids, n * sizeof(int));
+    qsort(sorted_ids, n, sizeof(int), compare_ints);
+    for (int i = 0; i < n; ++i) {
+        assert(is_correct_inode_id(sorted_ids[i]));
+        if (n_sorted == 0 || sorted_ids[n_sorted - 1] != sorted_ids[i]) {
+            sorted_ids[n_sorted++] = sorted_ids[i];
+        }
+    }
+
+    cached_read_inodes(sorted_ids, n_sorted, sorted_inodes, found);
+    for (int i = 0; i < n_sorted; ) {
+        if (found[i]) {
+            ++i;
+            continue;
+        }
+        int len = 1;
+        while (i + len < n_sorted && !found[i + len] && sorted_ids[i + len] == sorted_ids[i] + len) {
+            ++len;
+        }
+        read_data(sorted_inodes + i, len * sizeof(struct inode), get_inode_offset(sorted_ids[i]));
+        i += len;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        int* id = bsearch(inode_ids + i, sorted_ids, n_sorted, sizeof(int), compare_ints);
+        inodes[i] = sorted_inodes[id - sorted_ids];
+    }
 }
 
 void write_inode(const struct inode* inode, int inode_id) {
     assert(is_correct_inode_id(inode_id));
     write_data(inode, sizeof(struct inode), get_inode_offset(inode_id));
+    publish_inode(inode, inode_id);
 }
 
-int allocate_inode() {
-    if (update_superblock(0, -1) == -1) {
-        return -1;
-    }
-    int allocated_inode_id = -1;
+void init_inode_allocator() {
+    alloc_bitmap_init(&inode_bitmap, N_INODES, MINIFS_BLOCK_SIZE * 2);
+}
 
-    char inode_bitmap[N_INODES / 8];
-    read_inode_bitmap(inode_bitmap);
-    for (int i = 0; i < N_INODES / 8; ++i) {
-        int index = first_bit(inode_bitmap[i]);
-        if (index != -1) {
-            allocated_inode_id = i * 8 + index;
-            set_zero(inode_bitmap + i, index);
-            break;
-        }
+int get_n_free_inodes() {
+    return alloc_bitmap_n_free(&inode_bitmap);
+}
+
+// a reader that saw the bitmap held a moment ago may still be reading the held words when the next
+// holder overwrites them, which only shows it the bitmap as of then instead
+void hold_inode_bitmap() {
+    for (int i = 0; i < inode_bitmap.n_groups; ++i) {
+        atomic_store(held_inode_words + i, atomic_load(inode_bitmap.words + i));
     }
-    write_inode_bitmap(inode_bitmap);
+    holding_inode_bitmap = 1;
+    atomic_store(&inode_bitmap_held, 1);
+}
 
-    return allocated_inode_id;
+void publish_inode_bitmap() {
+    atomic_store(&inode_bitmap_held, 0);
+    holding_inode_bitmap = 0;
 }
 
-int free_inode(int inode_id) {
-    if (!is_correct_inode_id(inode_id) || update_superblock(0, 1) == -1) {
+int allocate_inode() {
+    return allocate_inode_near(-1);
+}
+
+int allocate_inode_near(int inode_id) {
+    // inodes of the same directory go to the same group, unrelated ones spread over the cpus' groups
+    int group = (is_correct_inode_id(inode_id) ? get_group(inode_id) : get_cpu_group(&inode_bitmap));
+    int allocated_inode_id = alloc_bitmap_allocate(&inode_bitmap, group);
+    if (allocated_inode_id == -1) {
         return -1;
     }
+    sync_superblock();
+    return allocated_inode_id;
+}
 
-    char byte;
-    read_data(&byte, 1, MINIFS_BLOCK_SIZE * 2 + inode_id / 8);
-    if (is_one(byte, inode_id % 8)) {
+int free_inode(int inode_id) {
+    if (!is_correct_inode_id(inode_id) || alloc_bitmap_free(&inode_bitmap, inode_id) == -1) {
         return -1;
     }
-    set_one(&byte, inode_id % 8);
-    write_data(&byte, 1, MINIFS_BLOCK_SIZE * 2 + inode_id / 8);
+    sync_superblock();
+    return 0;
+}
 
+int allocate_inodes_near(int inode_id, int n, int* inode_ids) {
+    int group = (is_correct_inode_id(inode_id) ? get_group(inode_id) : get_cpu_group(&inode_bitmap));
+    for (int n_allocated = 0; n_allocated < n; ) {
+        int first_inode_id;
+        int len = alloc_bitmap_allocate_run(&inode_bitmap, group, n - n_allocated, &first_inode_id);
+        if (len == 0) {
+            free_inodes(n_allocated, inode_ids);
+            return -1;
+        }
+        for (int i = 0; i < len; ++i) {
+            inode_ids[n_allocated++] = first_inode_id + i;
+        }
+        group = get_group(first_inode_id);
+    }
+    sync_superblock();
     return 0;
 }
 
+void free_inodes(int n, const int* inode_ids) {
+    alloc_bitmap_free_many(&inode_bitmap, n, inode_ids);
+    sync_superblock();
+}
+
 int init_dir(struct inode* inode, int inode_id, int parent_inode_id) {
     int block_id = allocate_block();
     if (block_id == -1) {
@@ -116,30 +207,28 @@ int check_user_id(int inode_id) {
 }
 
 int go(int inode_id, const char* filename) {
-    if (!is_dir(inode_id)) {
-        return -1;
-    }
-
-    struct inode inode;
-    read_inode(&inode, inode_id);
-
-    char block[MINIFS_BLOCK_SIZE];
-
-    for (int i = 0; i < N_DIRECT_PTRS; ++i) {
-        if (!is_correct_block_id(inode.direct[i])) {
-            continue;
-        }
-        read_block(block, inode.direct[i]);
-        for (struct entry* entry = (struct entry*)block; (void*)entry < (void*)block + MINIFS_BLOCK_SIZE; ++entry) {
-            if (is_allocated_inode_id(entry->inode_id) && strcmp(entry->filename, filename) == 0) {
-                if (!check_user_id(entry->inode_id)) {
-                    return -1;
-                }
-                return entry->inode_id;
+    int found_inode_id = -1;
+
+    // a listing that asked for a lease depends on every directory its path goes through
+    grant_lease(inode_id);
+    epoch_enter();
+    const struct dir_snapshot* snapshot = get_dir_snapshot(inode_id);
+    for (int i = 0; snapshot != NULL && i < snapshot->n_blocks && found_inode_id == -1; ++i) {
+        const struct entry* entries = snapshot->blocks[i];
+        for (uint32_t mask = dir_scan_name(entries, filename); mask != 0; mask &= mask - 1) {
+            const struct entry* entry = entries + __builtin_ctz(mask);
+            if (is_allocated_inode_id(entry->inode_id)) {
+                found_inode_id = entry->inode_id;
+                break;
             }
         }
     }
-    return -1;
+    epoch_exit();
+
+    if (found_inode_id == -1 || !check_user_id(found_inode_id)) {
+        return -1;
+    }
+    return found_inode_id;
 }
 
 int file_exists_in_dir(int dir_inode_id, const char* filename) {
@@ -254,6 +343,7 @@ int add_file_to_dir(int dir_inode_id, int file_inode_id, const char* filename) {
 
                 dir_inode.size += sizeof(struct entry);
                 write_inode(&dir_inode, dir_inode_id);
+                publish_dir_snapshot(dir_inode_id);
                 return 0;
             }
         }
@@ -262,21 +352,15 @@ int add_file_to_dir(int dir_inode_id, int file_inode_id, const char* filename) {
     return -1;
 }
 
-void remove_inode_regular(int inode_id) {
-    struct inode inode;
-    read_inode(&inode, inode_id);
-    for (int i = 0; i < N_DIRECT_PTRS; ++i) {
-        if (!is_correct_block_id(inode.direct[i])) {
-            break;
-        }
-        free_block(inode.direct[i]);
-    }
-    free_inode(inode_id);
-}
-
-void remove_inode(int);
+// what a removed tree gives back
+struct freed_tree {
+    int n_blocks;
+    int block_ids[N_BLOCKS];
+    int n_inodes;
+    int inode_ids[N_INODES];
+};
 
-void remove_inode_dir(int inode_id) {
+static void collect_tree(int inode_id, struct freed_tree* freed) {
     struct inode inode;
     read_inode(&inode, inode_id);
     char block[MINIFS_BLOCK_SIZE];
@@ -285,26 +369,38 @@ void remove_inode_dir(int inode_id) {
         if (!is_correct_block_id(inode.direct[i])) {
             break;
         }
-        read_block(block, inode.direct[i]);
-        for (struct entry* entry = (struct entry*)block; (char*)entry < block + MINIFS_BLOCK_SIZE; ++entry) {
-            if (strcmp(entry->filename, ".") == 0 || strcmp(entry->filename, "..") == 0) {
-                continue;
-            }
-            if (is_correct_inode_id(entry->inode_id)) {
-                remove_inode(entry->inode_id);
+        if (inode.file_type == DIRECTORY) {
+            read_block(block, inode.direct[i]);
+            for (struct entry* entry = (struct entry*)block; (char*)entry < block + MINIFS_BLOCK_SIZE; ++entry) {
+                if (strcmp(entry->filename, ".") == 0 || strcmp(entry->filename, "..") == 0) {
+                    continue;
+                }
+                if (is_allocated_inode_id(entry->inode_id)) {
+                    collect_tree(entry->inode_id, freed);
+                }
             }
         }
-        free_block(inode.direct[i]);
+        assert(freed->n_blocks < N_BLOCKS);
+        freed->block_ids[freed->n_blocks++] = inode.direct[i];
+    }
+    if (inode.file_type == DIRECTORY) {
+        drop_dir_snapshot(inode_id);
     }
-    free_inode(inode_id);
+    assert(freed->n_inodes < N_INODES);
+    freed->inode_ids[freed->n_inodes++] = inode_id;
 }
 
 void remove_inode(int inode_id) {
-    if (is_regular_file(inode_id)) {
-        remove_inode_regular(inode_id);
-    } else if (is_dir(inode_id)) {
-        remove_inode_dir(inode_id);
+    if (!is_regular_file(inode_id) && !is_dir(inode_id)) {
+        return;
     }
+    struct freed_tree* freed = malloc(sizeof(struct freed_tree));
+    freed->n_blocks = freed->n_inodes = 0;
+    collect_tree(inode_id, freed);
+    free_blocks(freed->n_blocks, freed->block_ids);
+    alloc_bitmap_free_many(&inode_bitmap, freed->n_inodes, freed->inode_ids);
+    sync_superblock();
+    free(freed);
 }
 
 int get_ref_count(int inode_id) {
@@ -322,18 +418,19 @@ int remove_file_from_dir(int dir_inode_id, int file_inode_id) {
             continue;
         }
         read_block(block, dir_inode.direct[i]);
-        for (struct entry* entry = (struct entry*)block; (char*)entry < block + MINIFS_BLOCK_SIZE; ++entry) {
-            if (entry->inode_id == file_inode_id) {
-                entry->inode_id = -1;
-                write_block(block, dir_inode.direct[i]);
-
-                dir_inode.size -= sizeof(struct entry);
-                write_inode(&dir_inode, dir_inode_id);
-                if (entry->filename[0] != '.') {
-                    decrement_ref_count(file_inode_id);
-                }
-                return 0;
+        uint32_t mask = dir_scan_inode(block, file_inode_id);
+        if (mask != 0) {
+            struct entry* entry = (struct entry*)block + __builtin_ctz(mask);
+            entry->inode_id = -1;
+            write_block(block, dir_inode.direct[i]);
+
+            dir_inode.size -= sizeof(struct entry);
+            write_inode(&dir_inode, dir_inode_id);
+            publish_dir_snapshot(dir_inode_id);
+            if (entry->filename[0] != '.') {
+                decrement_ref_count(file_inode_id);
             }
+            return 0;
         }
     }
     return -1;
@@ -371,6 +468,77 @@ int append_to_file(int inode_id, const void* data, int n_bytes) {
     return 0;
 }
 
+// bytes [from, to) of the file, which has blocks for them, read as zeroes from now on
+static void zero_range(const struct inode* inode, int from, int to) {
+    static const char zeroes[MINIFS_BLOCK_SIZE];
+    while (from < to) {
+        int in_block = from % MINIFS_BLOCK_SIZE;
+        int n_bytes_cur = min(to - from, MINIFS_BLOCK_SIZE - in_block);
+        write_data(zeroes, n_bytes_cur, DATA_OFFSET + inode->direct[from / MINIFS_BLOCK_SIZE] * MINIFS_BLOCK_SIZE + in_block);
+        from += n_bytes_cur;
+    }
+}
+
+// gives the file the blocks it needs to hold size bytes, all or nothing
+static int grow_blocks(struct inode* inode, int size) {
+    int n_blocks = get_n_blocks_needed(inode->size);
+    int n_blocks_needed = get_n_blocks_needed(size);
+    if (n_blocks_needed <= n_blocks) {
+        return 0;
+    }
+    if (reserve_blocks(n_blocks_needed - n_blocks, inode->direct + n_blocks) == -1) {
+        memset(inode->direct + n_blocks, -1, (n_blocks_needed - n_blocks) * sizeof(int));
+        return -1;
+    }
+    return 0;
+}
+
+int write_to_file(int inode_id, const void* data, int offset, int n_bytes) {
+    struct inode inode;
+    read_inode(&inode, inode_id);
+    int end = offset + n_bytes;
+    if (grow_blocks(&inode, (end > inode.size ? end : inode.size)) == -1) {
+        return -1;
+    }
+    // a write past the end leaves a hole that reads as zeroes
+    if (offset > inode.size) {
+        zero_range(&inode, inode.size, offset);
+    }
+    for (int pos = offset; pos < end; ) {
+        int in_block = pos % MINIFS_BLOCK_SIZE;
+        int n_bytes_cur = min(end - pos, MINIFS_BLOCK_SIZE - in_block);
+        write_data((const char*)data + (pos - offset), n_bytes_cur,
+                   DATA_OFFSET + inode.direct[pos / MINIFS_BLOCK_SIZE] * MINIFS_BLOCK_SIZE + in_block);
+        pos += n_bytes_cur;
+    }
+    if (end > inode.size) {
+        inode.size = end;
+    }
+    inode.last_modified = time(NULL);
+    write_inode(&inode, inode_id);
+    return 0;
+}
+
+int resize_file(int inode_id, int size) {
+    struct inode inode;
+    read_inode(&inode, inode_id);
+    if (size < inode.size) {
+        for (int ptr = get_n_blocks_needed(size); ptr < get_n_blocks_needed(inode.size); ++ptr) {
+            free_block(inode.direct[ptr]);
+            inode.direct[ptr] = -1;
+        }
+    } else {
+        if (grow_blocks(&inode, size) == -1) {
+            return -1;
+        }
+        zero_range(&inode, inode.size, size);
+    }
+    inode.size = size;
+    inode.last_modified = time(NULL);
+    write_inode(&inode, inode_id);
+    return 0;
+}
+
 int rename_file_in_dir(int dir_inode_id, const char* filename, const char* new_filename) {
     struct inode dir_inode;
     read_inode(&dir_inode, dir_inode_id);
@@ -380,32 +548,65 @@ int rename_file_in_dir(int dir_inode_id, const char* filename, const char* new_f
             continue;
         }
         read_block(block, dir_inode.direct[i]);
-        for (struct entry* entry = (struct entry*)block; (char*)entry < block + MINIFS_BLOCK_SIZE; ++entry) {
-            if (strcmp(entry->filename, filename) == 0) {
-                strcpy(entry->filename, new_filename);
-                write_block(block, dir_inode.direct[i]);
-                return 0;
-            }
+        uint32_t mask = dir_scan_name(block, filename);
+        if (mask != 0) {
+            struct entry* entry = (struct entry*)block + __builtin_ctz(mask);
+            strcpy(entry->filename, new_filename);
+            write_block(block, dir_inode.direct[i]);
+            publish_dir_snapshot(dir_inode_id);
+            return 0;
         }
     }
     return -1;
 }
 
 int get_filename_by_inode(int dir_inode_id, int inode_id, char* filename) {
-    struct inode dir_inode;
-    read_inode(&dir_inode, dir_inode_id);
-    char block[MINIFS_BLOCK_SIZE];
-    for (int i = 0; i < N_DIRECT_PTRS; ++i) {
-        if (!is_correct_block_id(dir_inode.direct[i])) {
-            continue;
+    int found = -1;
+    epoch_enter();
+    const struct dir_snapshot* snapshot = get_dir_snapshot(dir_inode_id);
+    for (int i = 0; snapshot != NULL && i < snapshot->n_blocks; ++i) {
+        uint32_t mask = dir_scan_inode(snapshot->blocks[i], inode_id);
+        if (mask != 0) {
+            strcpy(filename, snapshot->blocks[i][__builtin_ctz(mask)].filename);
+            found = 0;
+            break;
         }
-        read_block(block, dir_inode.direct[i]);
-        for (struct entry* entry = (struct entry*)block; (char*)entry < block + MINIFS_BLOCK_SIZE; ++entry) {
-            if (entry->inode_id == inode_id) {
-                strcpy(filename, entry->filename);
-                return 0;
+    }
+    epoch_exit();
+    return found;
+}
+
+int dir_cursor_at_end(const struct dir_cursor* cursor) {
+    return cursor->block_idx >= N_DIRECT_PTRS;
+}
+
+int read_dir_entries(int dir_inode_id, struct dir_cursor* cursor, struct entry* entries, int max_entries) {
+    int n = 0;
+    epoch_enter();
+    const struct dir_snapshot* snapshot = get_dir_snapshot(dir_inode_id);
+    int n_blocks = (snapshot == NULL ? 0 : snapshot->n_blocks);
+    int i = 0;
+    while (i < n_blocks && snapshot->direct_idx[i] < cursor->block_idx) {
+        ++i;
+    }
+    for (; i < n_blocks; ++i) {
+        if (snapshot->direct_idx[i] != cursor->block_idx) {
+            // the block the cursor pointed at is gone, resume at the next one
+            cursor->block_idx = snapshot->direct_idx[i];
+            cursor->slot = 0;
+        }
+        for (; cursor->slot < ENTRIES_PER_BLOCK; ++cursor->slot) {
+            if (n == max_entries) {
+                epoch_exit();
+                return n;
+            }
+            if (is_correct_inode_id(snapshot->blocks[i][cursor->slot].inode_id)) {
+                entries[n++] = snapshot->blocks[i][cursor->slot];
             }
         }
     }
-    return -1;
+    cursor->block_idx = N_DIRECT_PTRS;
+    cursor->slot = 0;
+    epoch_exit();
+    return n;
 }
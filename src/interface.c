@@ -12,11 +12,14 @@
 #include "interface.h"
 #include "inode.h"
 #include "block.h"
+#include "disk_io.h"
+#include "meta_cache.h"
 #include "str_util.h"
 #include "net_io.h"
+#include "lease.h"
+#include "compress.h"
 
 int change_dir(const char* path) {
-    read_lock();
     int dest_inode_id = traverse(path);
     if (is_dir(dest_inode_id)) {
         send_success();
@@ -26,70 +29,48 @@ int change_dir(const char* path) {
         print_work_path();
         nested = 0;
 
-        unlock();
         return work_inode_id;
     } else {
         send_failure("invalid path or permission denied\n");
-        unlock();
         return -1;
     }
 }
 
-int remove(const char* path) {
-    write_lock();
+int create_file(const char* path, enum file_type file_type) {
     int parent_inode_id;
     char* filename;
     get_parent_and_filename(path, &parent_inode_id, &filename);
-    int inode_id = go(parent_inode_id, filename);
+    int new_inode_id = create_file_in_dir(parent_inode_id, filename, file_type);
     free(filename);
+    return new_inode_id;
+}
 
-    if (inode_id == ROOT_INODE_ID) {
-        send_failure("permission denied\n");
-        unlock();
-        return -1;
+// whether filename can be added to the directory; returns the reason if it can't
+static const char* check_new_entry(int parent_inode_id, const char* filename) {
+    if (parent_inode_id == -1 || !is_dir(parent_inode_id)) {
+        return "incorrect path or permission denied\n";
     }
-    if (!is_allocated_inode_id(inode_id)) {
-        send_failure("invalid path or permission denied\n");
-        unlock();
-        return -1;
+    if (file_exists_in_dir(parent_inode_id, filename)) {
+        return "file already exists\n";
     }
-    if (remove_file_from_dir(parent_inode_id, inode_id) == -1) {
-        send_failure("no such file\n");
-        unlock();
-        return -1;
+    if (get_free_space_in_file(parent_inode_id) < sizeof(struct entry)) {
+        return "not enough space in directory\n";
     }
-    send_success();
-    unlock();
-    return 0;
+    return NULL;
 }
 
-int create_file(const char* path, enum file_type file_type) {
-    write_lock();
-    if (file_exists(path)) {
-        send_failure("file already exists\n");
-        unlock();
-        return -1;
-    }
-    int parent_inode_id;
-    char* filename;
-    get_parent_and_filename(path, &parent_inode_id, &filename);
-    if (parent_inode_id == -1 || !is_dir(parent_inode_id)) {
-        send_failure("incorrect path or permission denied\n");
-        free(filename);
-        unlock();
-        return -1;
-    }
-    if (get_free_space_in_file(parent_inode_id) < sizeof(struct entry)) {
-        send_failure("not enough space in directory\n");
-        free(filename);
-        unlock();
+int create_file_in_dir(int parent_inode_id, const char* filename, enum file_type file_type) {
+    lock_inode(parent_inode_id, LOCK_WRITE);
+    const char* error = check_new_entry(parent_inode_id, filename);
+    if (error != NULL) {
+        send_failure(error);
+        unlock_inode(parent_inode_id);
         return -1;
     }
                                     // a directory requires a block immediately
     if (get_n_free_inodes() == 0 || (file_type == DIRECTORY && get_n_free_blocks() == 0)) {
         send_failure("not enough space in MiniFS\n");
-        free(filename);
-        unlock();
+        unlock_inode(parent_inode_id);
         return -1;
     }
     send_success();
@@ -103,7 +84,7 @@ int create_file(const char* path, enum file_type file_type) {
     inode.last_modified = time(NULL);
     inode.user_id       = user_id;
     memset(inode.direct, -1, sizeof(inode.direct));
-    int new_inode_id = allocate_inode();
+    int new_inode_id = allocate_inode_near(parent_inode_id);
     if (file_type == DIRECTORY) {
         init_dir(&inode, new_inode_id, parent_inode_id);
     }
@@ -112,44 +93,165 @@ int create_file(const char* path, enum file_type file_type) {
     // but currently it's isolated from the general hierarchy
     add_file_to_dir(parent_inode_id, new_inode_id, filename);
 
-    free(filename);
-    unlock();
+    unlock_inode(parent_inode_id);
     return new_inode_id;
 }
 
-int list_entries(const char* path, int all) {
-    read_lock();
+static void format_time(char* buf, size_t size, const char* format, time_t time) {
+    struct tm tm;
+    strftime(buf, size, format, localtime_r(&time, &tm));
+}
+
+// inode is NULL unless it's the long format: type, links, owner, size and modification time
+static void append_entry(struct strbuf* reply, const struct entry* entry, const struct inode* inode) {
+    if (inode != NULL) {
+        char mtime[32];
+        format_time(mtime, sizeof(mtime), "%Y-%m-%d %H:%M", inode->last_modified);
+        strbuf_appendf(reply, "%c %3d %5d %8d %s ", (inode->file_type == DIRECTORY ? 'd' : '-'),
+                       inode->ref_count, inode->user_id, inode->size, mtime);
+    }
+    strbuf_append(reply, entry->filename, strlen(entry->filename));
+    strbuf_append(reply, "\n", 1);
+}
+
+// appends up to max_entries entries to the reply, returns the number of entries scanned;
+// in the long format, the inodes of each batch of entries are read together
+static int append_entries(struct strbuf* reply, int inode_id, struct dir_cursor* cursor,
+                          int max_entries, int all, int long_format) {
+    struct entry entries[READDIR_BATCH_SIZE];
+    int inode_ids[READDIR_BATCH_SIZE];
+    struct inode inodes[READDIR_BATCH_SIZE];
+    int n_scanned = 0;
+    while (n_scanned < max_entries && !dir_cursor_at_end(cursor)) {
+        int n = read_dir_entries(inode_id, cursor, entries, min(max_entries - n_scanned, READDIR_BATCH_SIZE));
+        n_scanned += n;
+        int n_shown = 0;
+        for (int i = 0; i < n; ++i) {
+            if (all || entries[i].filename[0] != '.') {
+                entries[n_shown] = entries[i];
+                inode_ids[n_shown++] = entries[i].inode_id;
+            }
+        }
+        if (long_format) {
+            for (int i = 0; i < n_shown; ++i) {
+                grant_lease(inode_ids[i]);
+            }
+            read_inodes(inode_ids, n_shown, inodes);
+        }
+        for (int i = 0; i < n_shown; ++i) {
+            append_entry(reply, entries + i, long_format ? inodes + i : NULL);
+        }
+    }
+    return n_scanned;
+}
+
+int list_entries(const char* path, int all, int long_format) {
     int inode_id = (path == NULL ? work_inode_id : traverse(path));
 
     if (!is_dir(inode_id)) {
         send_failure("not a directory or permission denied\n");
-        unlock();
         return -1;
     }
+
+    grant_lease(inode_id);
+    struct strbuf* reply = get_reply_buf();
+    struct dir_cursor cursor = DIR_CURSOR_START;
+    append_entries(reply, inode_id, &cursor, N_DIRECT_PTRS * ENTRIES_PER_BLOCK, all, long_format);
+
     send_success();
+    send_nbytes(reply->data, reply->len);
+    return 0;
+}
 
-    struct inode inode;
-    read_inode(&inode, inode_id);
-    char block[MINIFS_BLOCK_SIZE];
+int read_dir(const char* path, int all, int long_format, struct dir_cursor cursor, int max_entries) {
+    int inode_id = (path == NULL ? work_inode_id : traverse(path));
 
-    for (int i = 0; i < N_DIRECT_PTRS; ++i) {
-        if (!is_correct_block_id(inode.direct[i])) {
+    if (!is_dir(inode_id)) {
+        send_failure("not a directory or permission denied\n");
+        return -1;
+    }
+    if (cursor.block_idx < 0 || cursor.slot < 0 || cursor.slot >= ENTRIES_PER_BLOCK || max_entries <= 0) {
+        send_failure("invalid cursor\n");
+        return -1;
+    }
+
+    grant_lease(inode_id);
+    struct strbuf* reply = get_reply_buf();
+    append_entries(reply, inode_id, &cursor, max_entries, all, long_format);
+
+    // the last line tells the client where to resume from
+    if (dir_cursor_at_end(&cursor)) {
+        strbuf_appendf(reply, "cursor end\n");
+    } else {
+        strbuf_appendf(reply, "cursor %d:%d\n", cursor.block_idx, cursor.slot);
+    }
+    send_success();
+    send_nbytes(reply->data, reply->len);
+    return 0;
+}
+
+int stat_files(char** paths, int n_paths) {
+    if (n_paths == 0) {
+        send_failure("missing operand\n");
+        return -1;
+    }
+    if (n_paths > N_INODES) {
+        send_failure("too many paths\n");
+        return -1;
+    }
+    // the paths are resolved first so that all the inodes can be read together;
+    // slots[i] is where the inode of paths[i] goes, -1 if it didn't resolve
+    int slots[N_INODES];
+    int inode_ids[N_INODES];
+    int n_found = 0;
+    for (int i = 0; i < n_paths; ++i) {
+        int inode_id = traverse(paths[i]);
+        if (is_allocated_inode_id(inode_id)) {
+            slots[i] = n_found;
+            inode_ids[n_found++] = inode_id;
+        } else {
+            slots[i] = -1;
+        }
+    }
+    struct inode inodes[N_INODES];
+    if (n_found > 0) {
+        read_inodes(inode_ids, n_found, inodes);
+    }
+
+    struct strbuf* reply = get_reply_buf();
+    int n_failed = 0;
+    for (int i = 0; i < n_paths; ++i) {
+        if (slots[i] == -1) {
+            strbuf_appendf(reply, "%s: invalid path or permission denied\n", paths[i]);
+            ++n_failed;
             continue;
         }
-        read_block(block, inode.direct[i]);
-        for (struct entry* entry = (struct entry*)block; (void*)entry < (void*)block + MINIFS_BLOCK_SIZE; ++entry) {
-            if (is_correct_inode_id(entry->inode_id)) {
-                if (!all && entry->filename[0] == '.') {
-                    continue;
-                }
-                send_msg(entry->filename);
-                send_msg("\n");
-            }
+        const struct inode* inode = inodes + slots[i];
+        char atime[32], mtime[32], ctime[32];
+        format_time(atime, sizeof(atime), "%Y-%m-%d %H:%M:%S", inode->last_accessed);
+        format_time(mtime, sizeof(mtime), "%Y-%m-%d %H:%M:%S", inode->last_modified);
+        format_time(ctime, sizeof(ctime), "%Y-%m-%d %H:%M:%S", inode->created);
+        int n_blocks = 0;
+        for (int j = 0; j < N_DIRECT_PTRS; ++j) {
+            n_blocks += is_correct_block_id(inode->direct[j]);
         }
+        strbuf_appendf(reply,
+                       "  File: %s\n"
+                       "  Type: %s  Size: %d  Blocks: %d\n"
+                       " Inode: %d  Links: %d  Owner: %d\n"
+                       "Access: %s\n"
+                       "Modify: %s\n"
+                       "Create: %s\n",
+                       paths[i], (inode->file_type == DIRECTORY ? "directory" : "regular file"), inode->size,
+                       n_blocks, inode_ids[slots[i]], inode->ref_count, inode->user_id, atime, mtime, ctime);
     }
-
-    unlock();
-    return 0;
+    if (n_failed > 0) {
+        send_failure("");
+    } else {
+        send_success();
+    }
+    send_nbytes(reply->data, reply->len);
+    return (n_failed > 0 ? -1 : 0);
 }
 
 void display_help() {
@@ -160,114 +262,296 @@ void display_help() {
         "* help                         display help\n"
         "* exit                         exit from MiniFS\n"
         "* cd path                      change current directory along path\n"
-        "* ls [path]                    list files in current directory or by path\n"
+        "* ls [options] [path]          list files in current directory or by path\n"
         "                               options: \n"
-        "                                 --all    don't omit files starting with '.'\n"
+        "                                 --all, -a     don't omit files starting with '.'\n"
+        "                                 --long, -l    show type, links, owner, size and modification time\n"
+        "* readdir [options] [path]     list one batch of entries and print the cursor to resume from\n"
+        "                               options: \n"
+        "                                 --all, --long    same as for ls\n"
+        "                                 --cursor B:S     resume at block B, slot S\n"
+        "                                 --count N        scan at most N entries\n"
         "* cp [options] src dest        make a copy of src at dest\n"
         "                               options: \n"
+        "                                 -r              copy a directory with everything in it\n"
         "                                 --from-local    copy a local file to MiniFS\n"
         "                                 --to-local      copy a file from MiniFS to local FS\n"
+        "                                 --streams N     with either of these, split the file into N parts\n"
+        "                                                 moved over separate connections at once\n"
+        "                               a trailing '&' runs a local copy in the background\n"
+        "* wait                         wait for the copies running in the background\n"
+        "* put [-r] local dest          copy a local file or directory tree to MiniFS\n"
+        "* get [-r] src local           copy a file or directory tree from MiniFS to local FS\n"
+        "                               many files are moved at once, the throughput is printed at the end\n"
+        "* batch [--atomic] file        run the mkdir, touch, cp, mv and rm lines of a local file at once\n"
+        "                               options: \n"
+        "                                 --atomic    undo the whole batch if a line fails\n"
         "* rm path                      remove file or directory\n"
         "* mv src dest                  move src to dest\n"
         "* mkdir path                   create a directory\n"
         "* touch path                   create a file\n"
         "* cat path                     print contents of a file\n"
+        "* read path offset length      print length bytes of a file starting at offset\n"
+        "* write [options] path offset [text]\n"
+        "                               write text into a file at offset, growing it if needed\n"
+        "                               options: \n"
+        "                                 --from-local file    write the contents of a local file instead\n"
+        "* truncate path size           cut a file short or extend it with zeroes\n"
+        "* du [options] [path]          print the space taken by each directory under path, in KiB\n"
+        "                               options: \n"
+        "                                 --summarize     only for path itself\n"
+        "                                 --parallel N    walk the subdirectories with N threads\n"
+        "* find [options] [path]        print the paths of the files under path that match all of the options\n"
+        "                               options: \n"
+        "                                 --name pattern  file name, with * ? [...] as in the shell\n"
+        "                                 --type f|d      regular files or directories\n"
+        "                                 --size [+-]N    more than, less than or exactly N bytes\n"
+        "                                 --mtime [+-]N   modified more than, less than or exactly N days ago\n"
+        "                                 --parallel N    same as for du\n"
+        "* stat path...                 print type, size, owner, links and times of files\n"
         "* pwd                          print path to current working directory\n"
         "-----------------------------------------------------------------\n"
     );
 }
 
-int copy_from_local(const char* dest_path) {
-    write_lock();
-    send_success(); // sync
-    size_t size;
-    recv_nbytes(&size, sizeof(size));
-    if (size > (int64_t)MAX_FILE_SIZE) {
+// bytes [offset, offset + len) of a file as runs of consecutive blocks, so that each run is moved in one call;
+// the range must lie within the file
+static int get_data_runs(const int* block_ids, int offset, int len, struct disk_range runs[N_DIRECT_PTRS]) {
+    int n_runs = 0;
+    for (int pos = offset, end = offset + len; pos < end; ) {
+        int ptr = pos / MINIFS_BLOCK_SIZE;
+        int in_block = pos % MINIFS_BLOCK_SIZE;
+        int n_bytes_cur = (end - pos < MINIFS_BLOCK_SIZE - in_block ? end - pos : MINIFS_BLOCK_SIZE - in_block);
+        off_t disk_offset = DATA_OFFSET + (off_t)MINIFS_BLOCK_SIZE * block_ids[ptr] + in_block;
+        if (n_runs > 0 && runs[n_runs - 1].offset + (off_t)runs[n_runs - 1].len == disk_offset) {
+            runs[n_runs - 1].len += n_bytes_cur;
+        } else {
+            runs[n_runs].offset = disk_offset;
+            runs[n_runs].len    = n_bytes_cur;
+            ++n_runs;
+        }
+        pos += n_bytes_cur;
+    }
+    return n_runs;
+}
+
+struct staged_upload {
+    int             parent_inode_id;
+    char*           filename;
+    size_t          size;
+    int             n_blocks;
+    int             block_ids[N_DIRECT_PTRS];
+    pthread_mutex_t mutex;
+    int             n_ranges_left;
+    int             failed;
+};
+
+// the file is received into blocks reserved up front and only reachable by nobody but us,
+// so no lock is held while waiting for the client; the new inode is linked into the directory at the end
+struct staged_upload* stage_upload(const char* dest_path, size_t size, int n_ranges) {
+    if (size > MAX_FILE_SIZE) {
         send_failure("file too big\n");
-        unlock();
+        return NULL;
+    }
+
+    int parent_inode_id;
+    char* filename;
+    get_parent_and_filename(dest_path, &parent_inode_id, &filename);
+    // fail early if possible, it's checked again when linking
+    const char* error = check_new_entry(parent_inode_id, filename);
+    if (error != NULL) {
+        send_failure(error);
+        free(filename);
+        return NULL;
+    }
+    struct staged_upload* upload = malloc(sizeof(struct staged_upload));
+    upload->n_blocks = get_n_blocks_needed((int)size);
+    if (reserve_blocks(upload->n_blocks, upload->block_ids) == -1) {
+        send_failure("not enough free blocks left\n");
+        free(filename);
+        free(upload);
+        return NULL;
+    }
+    upload->parent_inode_id = parent_inode_id;
+    upload->filename        = filename;
+    upload->size            = size;
+    upload->n_ranges_left   = n_ranges;
+    upload->failed          = 0;
+    pthread_mutex_init(&upload->mutex, NULL);
+    return upload;
+}
+
+int recv_upload_range(struct staged_upload* upload, size_t offset, size_t len) {
+    struct msg_header data;
+    if (recv_header(&data) == -1) {
+        send_failure("expected the file contents\n");
         return -1;
     }
-    if (get_n_blocks_needed((int)size) > get_n_free_blocks()) {
-        send_failure("not enough free blocks left");
-        unlock();
+    int compressed = (data.flags & REQUEST_COMPRESSED);
+    if (data.opcode != OP_DATA || (compressed ? data.payload_len > compress_bound(len) : data.payload_len != len)) {
+        send_failure("expected the file contents\n");
+        // whatever was sent instead is still in the stream
+        drop_connection();
         return -1;
     }
+    struct disk_range runs[N_DIRECT_PTRS];
+    int n_runs = get_data_runs(upload->block_ids, offset, len, runs);
+    if (compressed) {
+        return recv_compressed_disk_ranges(runs, n_runs, data.payload_len);
+    }
+    return recv_disk_ranges(runs, n_runs);
+}
 
-    nested = 1;
-    int inode_id = create_file(dest_path, REGULAR_FILE);
-    nested = 0;
-
+// the blocks become the new file's
+static int link_upload(struct staged_upload* upload) {
+    struct inode inode;
+    inode.file_type     = REGULAR_FILE;
+    inode.size          = upload->size;
+    inode.ref_count     = 0;
+    inode.created       =
+    inode.last_accessed =
+    inode.last_modified = time(NULL);
+    inode.user_id       = user_id;
+    memset(inode.direct, -1, sizeof(inode.direct));
+    memcpy(inode.direct, upload->block_ids, upload->n_blocks * sizeof(int));
+    int inode_id = allocate_inode_near(upload->parent_inode_id);
     if (inode_id == -1) {
-        send_failure("couldn't create file");
-        unlock();
+        send_failure("not enough space in MiniFS\n");
         return -1;
     }
-    send_success();
+    write_inode(&inode, inode_id);
 
-    char buf[MINIFS_BLOCK_SIZE];
-    for (int n_bytes_left = size; n_bytes_left > 0; n_bytes_left -= MINIFS_BLOCK_SIZE) {
-        int n_bytes_cur = (n_bytes_left < MINIFS_BLOCK_SIZE ? n_bytes_left : MINIFS_BLOCK_SIZE);
-        recv_nbytes(buf, n_bytes_cur);
-        append_to_file(inode_id, buf, n_bytes_cur);
+    lock_inode(upload->parent_inode_id, LOCK_WRITE);
+    const char* error = check_new_entry(upload->parent_inode_id, upload->filename);
+    if (error == NULL) {
+        add_file_to_dir(upload->parent_inode_id, inode_id, upload->filename);
     }
-    unlock();
+    unlock_inode(upload->parent_inode_id);
+
+    if (error != NULL) {
+        send_failure(error);
+        free_inode(inode_id);
+        return -1;
+    }
+    send_success();
     return inode_id;
 }
 
+int finish_upload_range(struct staged_upload* upload, int received) {
+    pthread_mutex_lock(&upload->mutex);
+    upload->failed |= !received;
+    int last = (--upload->n_ranges_left == 0);
+    int failed = upload->failed;
+    pthread_mutex_unlock(&upload->mutex);
+    if (!last) {
+        if (received) {
+            send_success();
+        }
+        return (received ? 0 : -1);
+    }
+
+    int result = -1;
+    if (!failed) {
+        result = link_upload(upload);
+    } else if (received) {
+        send_failure("another part of the upload failed\n");
+    }
+    if (result == -1) {
+        release_blocks(upload->n_blocks, upload->block_ids);
+    }
+    pthread_mutex_destroy(&upload->mutex);
+    free(upload->filename);
+    free(upload);
+    return result;
+}
+
+int copy_from_local(const char* dest_path, size_t size) {
+    struct staged_upload* upload = stage_upload(dest_path, size, 1);
+    if (upload == NULL) {
+        return -1;
+    }
+    // tell the client to go ahead with the contents
+    send_success();
+    int received = (flush_reply() == 0 && recv_upload_range(upload, 0, size) == 0);
+    return finish_upload_range(upload, received);
+}
+
+int put_file(const char* dest_path, const char* data, size_t size) {
+    struct staged_upload* upload = stage_upload(dest_path, size, 1);
+    if (upload == NULL) {
+        return -1;
+    }
+    struct disk_range runs[N_DIRECT_PTRS];
+    int n_runs = get_data_runs(upload->block_ids, 0, size, runs);
+    for (int i = 0; i < n_runs; ++i) {
+        write_data(data, runs[i].len, runs[i].offset);
+        data += runs[i].len;
+    }
+    return finish_upload_range(upload, 1);
+}
+
 int copy_to_local(const char* src_path) {
-    read_lock();
     int src_inode_id = traverse(src_path);
-    if (src_inode_id == -1) {
+    lock_inode(src_inode_id, LOCK_READ);
+    if (!is_allocated_inode_id(src_inode_id)) {
         send_failure("invalid path or permission denied\n");
-        unlock();
+        unlock_inode(src_inode_id);
         return -1;
     }
     struct inode src_inode;
     read_inode(&src_inode, src_inode_id);
     if (src_inode.file_type != REGULAR_FILE) {
         send_failure("not a regular file\n");
-        unlock();
+        unlock_inode(src_inode_id);
         return -1;
     }
-    send_success();
-    char buf[MINIFS_BLOCK_SIZE];
-    for (int n_bytes_left = src_inode.size, ptr = 0; n_bytes_left > 0; n_bytes_left -= MINIFS_BLOCK_SIZE, ++ptr) {
-        read_block(buf, src_inode.direct[ptr]);
-        int n_bytes_cur = (n_bytes_left < MINIFS_BLOCK_SIZE ? n_bytes_left : MINIFS_BLOCK_SIZE);
-        send_nbytes(buf, n_bytes_cur);
-    }
-    unlock();
-    return 0;
+    struct disk_range runs[N_DIRECT_PTRS];
+    int n_runs = get_data_runs(src_inode.direct, 0, src_inode.size, runs);
+    int result = send_disk_ranges(runs, n_runs);
+    unlock_inode(src_inode_id);
+    return result;
 }
 
 int copy(const char* src_path, const char* dest_path) {
-    write_lock();
     int src_inode_id = traverse(src_path);
-    if (src_inode_id == -1) {
+    int dest_parent_inode_id;
+    char* dest_filename;
+    get_parent_and_filename(dest_path, &dest_parent_inode_id, &dest_filename);
+
+    // while the destination directory is write-locked, nobody can reach the new file
+    // until it's completely filled
+    int locked[] = { src_inode_id, dest_parent_inode_id };
+    lock_inodes(locked, (enum lock_mode[]){ LOCK_READ, LOCK_WRITE }, 2);
+    if (!is_allocated_inode_id(src_inode_id)) {
         send_failure("invalid_path or permission denied\n");
-        unlock();
+        free(dest_filename);
+        unlock_inodes(locked, 2);
         return -1;
     }
     struct inode src_inode;
     read_inode(&src_inode, src_inode_id);
     if (src_inode.file_type != REGULAR_FILE) {
-        send_failure("not a regular file\n");
-        unlock();
+        send_failure("not a regular file, use cp -r for directories\n");
+        free(dest_filename);
+        unlock_inodes(locked, 2);
         return -1;
     }
     if (get_n_blocks_needed(src_inode.size) > get_n_free_blocks()) {
         send_failure("not enough free blocks in MiniFS\n");
-        unlock();
+        free(dest_filename);
+        unlock_inodes(locked, 2);
         return -1;
     }
 
+    // dest_path isn't resolved again: that would lock its ancestors out of order
     nested = 1;
-    int new_inode_id = create_file(dest_path, REGULAR_FILE);
+    int new_inode_id = create_file_in_dir(dest_parent_inode_id, dest_filename, REGULAR_FILE);
     nested = 0;
+    free(dest_filename);
 
     if (new_inode_id == -1) {
         send_failure("couldn't create file\n");
-        unlock();
+        unlock_inodes(locked, 2);
         return -1;
     }
     send_success();
@@ -278,21 +562,315 @@ int copy(const char* src_path, const char* dest_path) {
         int n_bytes_cur = (n_bytes_left < MINIFS_BLOCK_SIZE ? n_bytes_left : MINIFS_BLOCK_SIZE);
         append_to_file(new_inode_id, buf, n_bytes_cur);
     }
-    unlock();
+    unlock_inodes(locked, 2);
+    return new_inode_id;
+}
+
+// a tree being copied: the inodes and blocks of the copy are allocated up front
+// and handed out in the order the source is walked, so the copy is laid out sequentially
+struct tree_copy {
+    int n_inodes;
+    int src_inode_ids[N_INODES]; // the first N_INODES of them, in the order walked
+    int inode_ids[N_INODES];
+    int next_inode;
+    int n_blocks;
+    int block_ids[N_BLOCKS];
+    int next_block;
+};
+
+// a tree that keeps changing between being walked and being locked is walked with everything locked
+// on this try
+#define N_TREE_WALKS 8
+
+// entries owned by other users are left out of the copy
+static int is_copied_entry(const struct entry* entry) {
+    return strcmp(entry->filename, ".") != 0 && strcmp(entry->filename, "..") != 0
+           && is_allocated_inode_id(entry->inode_id) && check_user_id(entry->inode_id);
+}
+
+// what rm frees along with a directory, see collect_tree()
+static int is_removed_entry(const struct entry* entry) {
+    return strcmp(entry->filename, ".") != 0 && strcmp(entry->filename, "..") != 0
+           && is_allocated_inode_id(entry->inode_id);
+}
+
+// takes no locks; run on a tree that isn't locked, it gives the inodes to lock, which may be
+// out of date by then (a walk that goes past N_INODES can only have seen the tree change under it)
+static void count_tree(int inode_id, struct tree_copy* copy, int (*is_counted)(const struct entry*)) {
+    if (copy->n_inodes++ >= N_INODES) {
+        return;
+    }
+    copy->src_inode_ids[copy->n_inodes - 1] = inode_id;
+    struct inode inode;
+    read_inode(&inode, inode_id);
+    char block[MINIFS_BLOCK_SIZE];
+    for (int i = 0; i < N_DIRECT_PTRS; ++i) {
+        if (!is_correct_block_id(inode.direct[i])) {
+            continue;
+        }
+        ++copy->n_blocks;
+        if (inode.file_type != DIRECTORY) {
+            continue;
+        }
+        read_block(block, inode.direct[i]);
+        for (struct entry* entry = (struct entry*)block; (char*)entry < block + MINIFS_BLOCK_SIZE; ++entry) {
+            if (is_counted(entry)) {
+                count_tree(entry->inode_id, copy, is_counted);
+            }
+        }
+    }
+}
+
+static int is_same_tree(const struct tree_copy* a, const struct tree_copy* b) {
+    return a->n_inodes == b->n_inodes && a->n_blocks == b->n_blocks && a->n_inodes <= N_INODES
+           && memcmp(a->src_inode_ids, b->src_inode_ids, a->n_inodes * sizeof(int)) == 0;
+}
+
+// the directories from inode_id up to the root, -1 if they don't lead there
+static int get_ancestors(int inode_id, int* ancestors) {
+    for (int n = 0; is_correct_inode_id(inode_id) && n < N_INODES; ) {
+        ancestors[n++] = inode_id;
+        int parent_inode_id = go(inode_id, "..");
+        if (parent_inode_id == inode_id) {
+            return n;
+        }
+        inode_id = parent_inode_id;
+    }
+    return -1;
+}
+
+// with all of them locked, so that go() stays on locked directories
+static int are_ancestors(const int* ancestors, int n) {
+    for (int i = 0; i < n; ++i) {
+        if (go(ancestors[i], "..") != ancestors[i + 1 < n ? i + 1 : i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// returns the inode id of the copy
+static int copy_inode(int src_inode_id, int parent_inode_id, int ref_count, struct tree_copy* copy) {
+    int inode_id = copy->inode_ids[copy->next_inode++];
+    struct inode inode;
+    read_inode(&inode, src_inode_id);
+    inode.ref_count     = ref_count;
+    inode.created       =
+    inode.last_accessed =
+    inode.last_modified = time(NULL);
+    inode.user_id       = user_id;
+    if (inode.file_type == DIRECTORY) {
+        inode.size = 0;
+    }
+
+    char block[MINIFS_BLOCK_SIZE];
+    for (int i = 0; i < N_DIRECT_PTRS; ++i) {
+        if (!is_correct_block_id(inode.direct[i])) {
+            continue;
+        }
+        read_block(block, inode.direct[i]);
+        inode.direct[i] = copy->block_ids[copy->next_block++];
+        if (inode.file_type == DIRECTORY) {
+            for (struct entry* entry = (struct entry*)block; (char*)entry < block + MINIFS_BLOCK_SIZE; ++entry) {
+                if (strcmp(entry->filename, ".") == 0) {
+                    entry->inode_id = inode_id;
+                } else if (strcmp(entry->filename, "..") == 0) {
+                    entry->inode_id = parent_inode_id;
+                } else if (is_copied_entry(entry)) {
+                    entry->inode_id = copy_inode(entry->inode_id, inode_id, 1, copy);
+                } else {
+                    entry->inode_id = -1;
+                }
+                inode.size += (is_correct_inode_id(entry->inode_id) ? sizeof(struct entry) : 0);
+            }
+        }
+        write_block(block, inode.direct[i]);
+    }
+    write_inode(&inode, inode_id);
+    if (inode.file_type == DIRECTORY) {
+        publish_dir_snapshot(inode_id);
+    }
+    return inode_id;
+}
+
+// the source tree is read-locked and the destination directory write-locked, along with the directories
+// above it, which keeps a move from putting the destination into the source while it's being copied.
+// the inodes to lock are found before locking, so they're checked once locked and it's retried if they changed
+// (N_TREE_WALKS times at most)
+int copy_tree(const char* src_path, const char* dest_path) {
+    int src_inode_id = traverse(src_path);
+    if (is_regular_file(src_inode_id)) {
+        return copy(src_path, dest_path);
+    }
+
+    int dest_parent_inode_id;
+    char* dest_filename;
+    get_parent_and_filename(dest_path, &dest_parent_inode_id, &dest_filename);
+    struct tree_copy* copy = malloc(sizeof(struct tree_copy));
+    struct tree_copy* locked_tree = malloc(sizeof(struct tree_copy));
+    int locked[2 * N_INODES];
+    enum lock_mode modes[2 * N_INODES];
+    int n_locked;
+    int ancestors[N_INODES];
+    int n_ancestors;
+    const char* error = NULL;
+    for (int n_walks = 1; ; ++n_walks) {
+        int all_locked = (n_walks == N_TREE_WALKS);
+        if (all_locked) {
+            lock_all();
+        }
+        if (!is_dir(src_inode_id)) {
+            error = "invalid path or permission denied\n";
+        } else if ((n_ancestors = get_ancestors(dest_parent_inode_id, ancestors)) == -1) {
+            error = "incorrect path or permission denied\n";
+        }
+        if (error != NULL) {
+            if (all_locked) {
+                unlock_all();
+            }
+            break;
+        }
+        memset(locked_tree, 0, sizeof(struct tree_copy));
+        count_tree(src_inode_id, locked_tree, is_copied_entry);
+        if (locked_tree->n_inodes > N_INODES) {
+            continue;
+        }
+        n_locked = 0;
+        for (int i = 0; i < locked_tree->n_inodes; ++i) {
+            locked[n_locked] = locked_tree->src_inode_ids[i];
+            modes[n_locked++] = LOCK_READ;
+        }
+        for (int i = 0; i < n_ancestors; ++i) {
+            locked[n_locked] = ancestors[i];
+            modes[n_locked++] = (i == 0 ? LOCK_WRITE : LOCK_READ);
+        }
+        lock_inodes(locked, modes, n_locked);
+        // the tree can't have changed since it was walked, so this is the last time around
+        if (all_locked) {
+            unlock_all();
+        }
+        memset(copy, 0, sizeof(struct tree_copy));
+        if (is_dir(src_inode_id)) {
+            count_tree(src_inode_id, copy, is_copied_entry);
+        }
+        if (is_same_tree(copy, locked_tree) && are_ancestors(ancestors, n_ancestors)) {
+            break;
+        }
+        unlock_inodes(locked, n_locked);
+    }
+    free(locked_tree);
+    if (error != NULL) {
+        send_failure(error);
+        free(dest_filename);
+        free(copy);
+        return -1;
+    }
+
+    error = check_new_entry(dest_parent_inode_id, dest_filename);
+    for (int i = 0; error == NULL && i < n_ancestors; ++i) {
+        if (ancestors[i] == src_inode_id) {
+            error = "can't copy a directory into itself\n";
+        }
+    }
+    if (error == NULL) {
+        // the destination directory may need another block for the entry
+        if (copy->n_blocks + 1 > get_n_free_blocks()
+            || allocate_inodes_near(dest_parent_inode_id, copy->n_inodes, copy->inode_ids) == -1) {
+            error = "not enough space in MiniFS\n";
+        } else if (reserve_blocks(copy->n_blocks, copy->block_ids) == -1) {
+            free_inodes(copy->n_inodes, copy->inode_ids);
+            error = "not enough space in MiniFS\n";
+        }
+    }
+    if (error != NULL) {
+        send_failure(error);
+        free(dest_filename);
+        free(copy);
+        unlock_inodes(locked, n_locked);
+        return -1;
+    }
+
+    int new_inode_id = copy_inode(src_inode_id, dest_parent_inode_id, 0, copy);
+    add_file_to_dir(dest_parent_inode_id, new_inode_id, dest_filename);
+    send_success();
+    free(dest_filename);
+    free(copy);
+    unlock_inodes(locked, n_locked);
     return new_inode_id;
 }
 
+// rm frees the whole tree under a directory, so all of it is write-locked along with the parent.
+// it's found before locking the same way copy_tree() finds its tree
+int remove(const char* path) {
+    int parent_inode_id;
+    char* filename;
+    get_parent_and_filename(path, &parent_inode_id, &filename);
+
+    struct tree_copy* tree = malloc(sizeof(struct tree_copy));
+    struct tree_copy* locked_tree = malloc(sizeof(struct tree_copy));
+    int locked[N_INODES + 1];
+    int n_locked;
+    int inode_id;
+    for (int n_walks = 1; ; ++n_walks) {
+        int all_locked = (n_walks == N_TREE_WALKS);
+        if (all_locked) {
+            lock_all();
+        }
+        inode_id = go(parent_inode_id, filename);
+        memset(locked_tree, 0, sizeof(struct tree_copy));
+        if (inode_id != ROOT_INODE_ID && is_allocated_inode_id(inode_id)) {
+            count_tree(inode_id, locked_tree, is_removed_entry);
+        }
+        if (locked_tree->n_inodes > N_INODES) {
+            continue;
+        }
+        locked[0] = parent_inode_id;
+        memcpy(locked + 1, locked_tree->src_inode_ids, locked_tree->n_inodes * sizeof(int));
+        n_locked = locked_tree->n_inodes + 1;
+        lock_inodes(locked, NULL, n_locked);
+        if (all_locked) {
+            unlock_all();
+        }
+        // the entry might have been replaced between the lookup and locking
+        if (go(parent_inode_id, filename) == inode_id) {
+            memset(tree, 0, sizeof(struct tree_copy));
+            if (inode_id != ROOT_INODE_ID && is_allocated_inode_id(inode_id)) {
+                count_tree(inode_id, tree, is_removed_entry);
+            }
+            if (is_same_tree(tree, locked_tree)) {
+                break;
+            }
+        }
+        unlock_inodes(locked, n_locked);
+    }
+    free(tree);
+    free(locked_tree);
+    free(filename);
+
+    if (inode_id == ROOT_INODE_ID) {
+        send_failure("permission denied\n");
+        unlock_inodes(locked, n_locked);
+        return -1;
+    }
+    if (!is_allocated_inode_id(inode_id)) {
+        send_failure("invalid path or permission denied\n");
+        unlock_inodes(locked, n_locked);
+        return -1;
+    }
+    if (remove_file_from_dir(parent_inode_id, inode_id) == -1) {
+        send_failure("no such file\n");
+        unlock_inodes(locked, n_locked);
+        return -1;
+    }
+    send_success();
+    unlock_inodes(locked, n_locked);
+    return 0;
+}
+
 int move(const char* src_path, const char* dest_path) {
-    write_lock();
     int src_inode_id = traverse(src_path);
     if (src_inode_id == -1 || src_inode_id == ROOT_INODE_ID) {
         send_failure("invalid source path or permission denied\n");
-        unlock();
-        return -1;
-    }
-    if (file_exists(dest_path)) {
-        send_failure("file at destination path already exists\n");
-        unlock();
         return -1;
     }
 
@@ -304,26 +882,60 @@ int move(const char* src_path, const char* dest_path) {
     char* dest_filename;
     get_parent_and_filename(dest_path, &dest_parent_inode_id, &dest_filename);
 
+    // the destination directory might be removed before it's locked, so the one above it is locked too
+    // and the entry looked up again there
+    int dest_grandparent_inode_id = go(dest_parent_inode_id, "..");
+    char dest_dir_name[FILENAME_LEN + 1];
+    if (get_filename_by_inode(dest_grandparent_inode_id, dest_parent_inode_id, dest_dir_name) == -1) {
+        dest_grandparent_inode_id = -1;
+    }
+
+    // a moved directory gets its '..' rewritten, so it's locked along with both parents
+    int locked[] = { src_parent_inode_id, dest_parent_inode_id, src_inode_id, dest_grandparent_inode_id };
+    lock_inodes(locked, (enum lock_mode[]){ LOCK_WRITE, LOCK_WRITE, LOCK_WRITE, LOCK_READ }, 4);
+
+    if (go(src_parent_inode_id, src_filename) != src_inode_id) {
+        send_failure("invalid source path or permission denied\n");
+        free(src_filename);
+        free(dest_filename);
+        unlock_inodes(locked, 4);
+        return -1;
+    }
+    if (dest_parent_inode_id != -1 && (dest_grandparent_inode_id == -1 || !is_dir(dest_parent_inode_id)
+                                       || go(dest_grandparent_inode_id, dest_dir_name) != dest_parent_inode_id)) {
+        send_failure("invalid path or permission denied\n");
+        free(src_filename);
+        free(dest_filename);
+        unlock_inodes(locked, 4);
+        return -1;
+    }
+    if (file_exists_in_dir(dest_parent_inode_id, dest_filename)) {
+        send_failure("file at destination path already exists\n");
+        free(src_filename);
+        free(dest_filename);
+        unlock_inodes(locked, 4);
+        return -1;
+    }
     if (src_parent_inode_id == dest_parent_inode_id) {
         rename_file_in_dir(src_parent_inode_id, src_filename, dest_filename);
         free(src_filename);
         free(dest_filename);
         send_success();
-        unlock();
+        unlock_inodes(locked, 4);
         return 0;
     }
     if (dest_parent_inode_id == -1) {
         send_failure("invalid path or permission denied\n");
         free(src_filename);
         free(dest_filename);
-        unlock();
+        unlock_inodes(locked, 4);
         return -1;
     }
     if (get_free_space_in_file(dest_parent_inode_id) < sizeof(struct entry)) {
         send_failure("not enough space in destination directory\n");
         free(src_filename);
         free(dest_filename);
-        unlock();
+        unlock_inodes(locked, 4);
         return -1;
     }
     send_success();
@@ -335,16 +947,14 @@ int move(const char* src_path, const char* dest_path) {
     }
     free(src_filename);
     free(dest_filename);
-    unlock();
+    unlock_inodes(locked, 4);
     return 0;
 }
 
 void print_work_path() {
-    read_lock();
     if (work_inode_id == ROOT_INODE_ID) {
         send_success();
         send_msg("/\n");
-        unlock();
         return;
     }
     char* buf = calloc(MAX_PATH_LEN, 1);
@@ -353,7 +963,12 @@ void print_work_path() {
     while (cur_inode_id != ROOT_INODE_ID) {
         int parent_inode_id = go(cur_inode_id, "..");
         char filename[FILENAME_LEN + 1];
-        get_filename_by_inode(parent_inode_id, cur_inode_id, filename);
+        if (get_filename_by_inode(parent_inode_id, cur_inode_id, filename) == -1) {
+            // the working directory was removed from under us
+            send_failure("working directory no longer exists\n");
+            free(buf);
+            return;
+        }
         reverse_str(filename);
         strcat(filename, "/");
         strcat(buf, filename);
@@ -364,35 +979,172 @@ void print_work_path() {
     send_msg(buf);
     send_msg("\n");
     free(buf);
-    unlock();
 }
 
 int print_contents(const char* path) {
-    read_lock();
     int inode_id = traverse(path);
+    lock_inode(inode_id, LOCK_READ);
     if (inode_id == -1) {
         send_failure("invalid path or permission denied\n");
-        unlock();
+        unlock_inode(inode_id);
         return -1;
     }
     if (!is_regular_file(inode_id)) {
         send_failure("not a regular file\n");
-        unlock();
+        unlock_inode(inode_id);
         return -1;
     }
-    send_success();
+    struct inode inode;
+    read_inode(&inode, inode_id);
+    struct disk_range runs[N_DIRECT_PTRS];
+    int n_runs = get_data_runs(inode.direct, 0, inode.size, runs);
+    int result = send_disk_ranges(runs, n_runs);
+    unlock_inode(inode_id);
+    return result;
+}
+
+int get_file_size(const char* path) {
+    int inode_id = traverse(path);
+    lock_inode(inode_id, LOCK_READ);
+    int size = -1;
+    if (inode_id == -1) {
+        send_failure("invalid path or permission denied\n");
+    } else if (!is_regular_file(inode_id)) {
+        send_failure("not a regular file\n");
+    } else {
+        struct inode inode;
+        read_inode(&inode, inode_id);
+        size = inode.size;
+    }
+    unlock_inode(inode_id);
+    return size;
+}
 
+int read_range(const char* path, long long offset, long long length) {
+    if (offset < 0 || length < 0) {
+        send_failure("invalid offset or length\n");
+        return -1;
+    }
+    int inode_id = traverse(path);
+    lock_inode(inode_id, LOCK_READ);
+    if (inode_id == -1) {
+        send_failure("invalid path or permission denied\n");
+        unlock_inode(inode_id);
+        return -1;
+    }
+    if (!is_regular_file(inode_id)) {
+        send_failure("not a regular file\n");
+        unlock_inode(inode_id);
+        return -1;
+    }
     struct inode inode;
     read_inode(&inode, inode_id);
-    char block[MINIFS_BLOCK_SIZE];
-    for (int i = 0; i < N_DIRECT_PTRS; ++i) {
-        if (!is_correct_block_id(inode.direct[i])) {
-            break;
-        }
-        read_block(block, inode.direct[i]);
-        int size = min(inode.size - MINIFS_BLOCK_SIZE * i, MINIFS_BLOCK_SIZE);
-        send_nbytes(block, size);
+    // like pread(), whatever part of the range is past the end of the file is left out
+    if (offset > inode.size) {
+        offset = inode.size;
     }
-    unlock();
-    return 0;
+    if (length > inode.size - offset) {
+        length = inode.size - offset;
+    }
+    struct disk_range runs[N_DIRECT_PTRS];
+    int n_runs = get_data_runs(inode.direct, offset, length, runs);
+    int result = send_disk_ranges(runs, n_runs);
+    unlock_inode(inode_id);
+    return result;
+}
+
+// looks the file up and locks it for writing together with its directory, which keeps the entry
+// in place; -1 if there's no such entry. the ids in locked[] are to be unlocked either way
+static int lock_file_entry(const char* path, int locked[2]) {
+    int parent_inode_id;
+    char* filename;
+    get_parent_and_filename(path, &parent_inode_id, &filename);
+    int inode_id = go(parent_inode_id, filename);
+
+    locked[0] = parent_inode_id;
+    locked[1] = inode_id;
+    lock_inodes(locked, (enum lock_mode[]){ LOCK_READ, LOCK_WRITE }, 2);
+    // the entry might have been replaced between the lookup and locking
+    if (inode_id != -1 && go(parent_inode_id, filename) != inode_id) {
+        inode_id = -1;
+    }
+    free(filename);
+    return inode_id;
+}
+
+// the data is received before the file is locked, so a slow client doesn't hold up its readers
+int write_range(const char* path, long long offset, long long size) {
+    if (offset < 0 || size < 0) {
+        send_failure("invalid offset or length\n");
+        return -1;
+    }
+    if (offset + size > MAX_FILE_SIZE) {
+        send_failure("file too big\n");
+        return -1;
+    }
+    int inode_id = traverse(path);
+    if (inode_id == -1) {
+        send_failure("invalid path or permission denied\n");
+        return -1;
+    }
+    if (!is_regular_file(inode_id)) {
+        send_failure("not a regular file\n");
+        return -1;
+    }
+    send_success();
+    if (flush_reply() == -1) {
+        return -1;
+    }
+
+    char* data = malloc(size + 1);
+    struct msg_header header;
+    if (recv_header(&header) == -1 || header.opcode != OP_DATA || header.payload_len != size
+        || recv_nbytes(data, size) == -1) {
+        send_failure("expected the data\n");
+        // whatever was sent instead may still be in the stream
+        drop_connection();
+        free(data);
+        return -1;
+    }
+
+    int locked[2];
+    // the file might have been removed in the meantime
+    int result = -1;
+    if (lock_file_entry(path, locked) != inode_id || !is_regular_file(inode_id)) {
+        send_failure("invalid path or permission denied\n");
+    } else if (write_to_file(inode_id, data, offset, size) == -1) {
+        send_failure("not enough space in MiniFS\n");
+    } else {
+        send_success();
+        result = 0;
+    }
+    unlock_inodes(locked, 2);
+    free(data);
+    return result;
+}
+
+int truncate_file(const char* path, long long size) {
+    if (size < 0) {
+        send_failure("invalid size\n");
+        return -1;
+    }
+    if (size > MAX_FILE_SIZE) {
+        send_failure("file too big\n");
+        return -1;
+    }
+    int locked[2];
+    int inode_id = lock_file_entry(path, locked);
+    int result = -1;
+    if (inode_id == -1) {
+        send_failure("invalid path or permission denied\n");
+    } else if (!is_regular_file(inode_id)) {
+        send_failure("not a regular file\n");
+    } else if (resize_file(inode_id, size) == -1) {
+        send_failure("not enough space in MiniFS\n");
+    } else {
+        send_success();
+        result = 0;
+    }
+    unlock_inodes(locked, 2);
+    return result;
 }
@@ -0,0 +1,167 @@
+#include <sys/socket.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "lease.h"
+#include "globals.h"
+#include "inode.h"
+#include "net_io.h"
+#include "protocol.h"
+
+struct lease {
+    struct conn*  conn;
+    uint32_t      lease_id;
+    time_t        expires;
+    struct lease* next;
+};
+
+// the leases on each inode; the heads are read without the mutex to skip inodes nobody holds
+static _Atomic(struct lease*) leases[N_INODES];
+static pthread_mutex_t leases_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local struct conn* holder;
+static _Thread_local uint32_t holder_lease_id;
+
+void set_lease_holder(struct conn* conn, uint32_t lease_id) {
+    holder          = conn;
+    holder_lease_id = lease_id;
+}
+
+// a revocation that found the connection's send_mutex taken, sent by whoever releases it
+// (see release_send_mutex()); under leases_mutex
+struct owed_revocation {
+    struct conn*            conn;
+    uint32_t                lease_id;
+    struct owed_revocation* next;
+};
+
+static struct owed_revocation* owed;
+static atomic_int n_owed; // read without the mutex to skip the list when it's empty
+
+// the caller holds conn->send_mutex and mustn't wait on a slow client, being a writer with the fs locks;
+// a client that can't take even a header off its socket is hung up on rather than left holding its leases
+static void send_revocation(struct conn* conn, uint32_t lease_id) {
+    struct msg_header notice = {
+        .opcode     = OP_REVOKE,
+        .status     = STATUS_OK,
+        .request_id = lease_id
+    };
+    unsigned char buf[MSG_HEADER_SIZE];
+    encode_header(&notice, buf);
+    if (send(conn->fd, buf, sizeof(buf), MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)sizeof(buf)) {
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+}
+
+// those owed to the connection with this send_mutex, which the caller holds along with leases_mutex
+static void send_owed_revocations(pthread_mutex_t* send_mutex) {
+    struct owed_revocation** link = &owed;
+    while (*link != NULL) {
+        struct owed_revocation* revocation = *link;
+        if (&revocation->conn->send_mutex != send_mutex) {
+            link = &revocation->next;
+            continue;
+        }
+        send_revocation(revocation->conn, revocation->lease_id);
+        *link = revocation->next;
+        free(revocation);
+        atomic_fetch_sub(&n_owed, 1);
+    }
+}
+
+// unlinks the leases on the inode held by conn (by anyone if it's NULL), only the expired ones if asked to;
+// with notify, the holders of the ones still running are sent OP_REVOKE, now or once their send_mutex is free
+static void remove_leases(int inode_id, struct conn* conn, int expired_only, int notify) {
+    time_t now = time(NULL);
+    struct lease* prev = NULL;
+    struct lease* lease = atomic_load(leases + inode_id);
+    while (lease != NULL) {
+        struct lease* next = lease->next;
+        int matches = (conn == NULL || lease->conn == conn) && (!expired_only || lease->expires < now);
+        if (!matches) {
+            prev = lease;
+            lease = next;
+            continue;
+        }
+        if (notify && lease->expires >= now) {
+            struct owed_revocation* revocation = malloc(sizeof(struct owed_revocation));
+            revocation->conn     = lease->conn;
+            revocation->lease_id = lease->lease_id;
+            revocation->next     = owed;
+            owed = revocation;
+            atomic_fetch_add(&n_owed, 1);
+            // pairs with the one in release_send_mutex(): either the trylock succeeds,
+            // or the thread holding send_mutex sees the revocation once it lets go
+            atomic_thread_fence(memory_order_seq_cst);
+            if (pthread_mutex_trylock(&lease->conn->send_mutex) == 0) {
+                send_owed_revocations(&lease->conn->send_mutex);
+                pthread_mutex_unlock(&lease->conn->send_mutex);
+            }
+        }
+        if (prev == NULL) {
+            atomic_store(leases + inode_id, next);
+        } else {
+            prev->next = next;
+        }
+        free(lease);
+        lease = next;
+    }
+}
+
+void grant_lease(int inode_id) {
+    if (holder == NULL || !is_correct_inode_id(inode_id)) {
+        return;
+    }
+    struct lease* lease = malloc(sizeof(struct lease));
+    lease->conn     = holder;
+    lease->lease_id = holder_lease_id;
+    lease->expires  = time(NULL) + LEASE_DURATION;
+    pthread_mutex_lock(&leases_mutex);
+    remove_leases(inode_id, holder, 1, 0);
+    lease->next = atomic_load(leases + inode_id);
+    atomic_store(leases + inode_id, lease);
+    pthread_mutex_unlock(&leases_mutex);
+    // pairs with the one in revoke_leases(): either the writer sees this lease,
+    // or the reader that follows sees what the writer published
+    atomic_thread_fence(memory_order_seq_cst);
+    add_reply_flags(RESPONSE_LEASED);
+}
+
+void revoke_leases(int inode_id) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(leases + inode_id) == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&leases_mutex);
+    remove_leases(inode_id, NULL, 0, 1);
+    pthread_mutex_unlock(&leases_mutex);
+}
+
+void release_send_mutex(pthread_mutex_t* send_mutex) {
+    pthread_mutex_unlock(send_mutex);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&n_owed) == 0) {
+        return;
+    }
+    pthread_mutex_lock(&leases_mutex);
+    // if it's been taken again, its new holder does this
+    if (pthread_mutex_trylock(send_mutex) == 0) {
+        send_owed_revocations(send_mutex);
+        pthread_mutex_unlock(send_mutex);
+    }
+    pthread_mutex_unlock(&leases_mutex);
+}
+
+void drop_leases(struct conn* conn) {
+    pthread_mutex_lock(&leases_mutex);
+    for (int i = 0; i < N_INODES; ++i) {
+        remove_leases(i, conn, 0, 0);
+    }
+    // nobody is sending to it anymore, so whatever it's still owed can go out now
+    pthread_mutex_lock(&conn->send_mutex);
+    send_owed_revocations(&conn->send_mutex);
+    pthread_mutex_unlock(&conn->send_mutex);
+    pthread_mutex_unlock(&leases_mutex);
+}
@@ -1,24 +1,101 @@
+#include <assert.h>
 #include <pthread.h>
 
 #include "lock.h"
 #include "globals.h"
 
-pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t stripes[N_LOCK_STRIPES] = {
+    [0 ... N_LOCK_STRIPES - 1] = PTHREAD_RWLOCK_INITIALIZER
+};
 
-void write_lock() {
-    if (!nested) {
-        pthread_rwlock_wrlock(&lock);
+// which stripes the current thread holds, and how many times it has locked each of them
+static _Thread_local struct {
+    int            count;
+    enum lock_mode mode;
+} held[N_LOCK_STRIPES];
+
+static int get_stripe(int inode_id) {
+    return inode_id % N_LOCK_STRIPES;
+}
+
+static void lock_stripe(int stripe, enum lock_mode mode) {
+    if (held[stripe].count > 0) {
+        assert(mode == LOCK_READ || held[stripe].mode == LOCK_WRITE);
+        ++held[stripe].count;
+        return;
+    }
+    if (mode == LOCK_WRITE) {
+        pthread_rwlock_wrlock(stripes + stripe);
+    } else {
+        pthread_rwlock_rdlock(stripes + stripe);
+    }
+    held[stripe].count = 1;
+    held[stripe].mode  = mode;
+}
+
+static void unlock_stripe(int stripe) {
+    assert(held[stripe].count > 0);
+    if (--held[stripe].count == 0) {
+        pthread_rwlock_unlock(stripes + stripe);
+    }
+}
+
+void lock_inode(int inode_id, enum lock_mode mode) {
+    if (0 <= inode_id && inode_id < N_INODES) {
+        lock_stripe(get_stripe(inode_id), mode);
+    }
+}
+
+void unlock_inode(int inode_id) {
+    if (0 <= inode_id && inode_id < N_INODES) {
+        unlock_stripe(get_stripe(inode_id));
+    }
+}
+
+// the strongest mode requested for each stripe, -1 if none
+static void collect_stripes(const int* inode_ids, const enum lock_mode* modes, int n, int wanted[N_LOCK_STRIPES]) {
+    for (int i = 0; i < N_LOCK_STRIPES; ++i) {
+        wanted[i] = -1;
+    }
+    for (int i = 0; i < n; ++i) {
+        if (0 <= inode_ids[i] && inode_ids[i] < N_INODES) {
+            int stripe = get_stripe(inode_ids[i]);
+            enum lock_mode mode = (modes == NULL ? LOCK_WRITE : modes[i]);
+            if (wanted[stripe] == -1 || mode == LOCK_WRITE) {
+                wanted[stripe] = mode;
+            }
+        }
+    }
+}
+
+void lock_inodes(const int* inode_ids, const enum lock_mode* modes, int n) {
+    int wanted[N_LOCK_STRIPES];
+    collect_stripes(inode_ids, modes, n, wanted);
+    for (int stripe = 0; stripe < N_LOCK_STRIPES; ++stripe) {
+        if (wanted[stripe] != -1) {
+            lock_stripe(stripe, wanted[stripe]);
+        }
+    }
+}
+
+void lock_all() {
+    for (int stripe = 0; stripe < N_LOCK_STRIPES; ++stripe) {
+        lock_stripe(stripe, LOCK_WRITE);
     }
 }
 
-void read_lock() {
-    if (!nested) {
-        pthread_rwlock_rdlock(&lock);
+void unlock_all() {
+    for (int stripe = N_LOCK_STRIPES - 1; stripe >= 0; --stripe) {
+        unlock_stripe(stripe);
     }
 }
 
-void unlock() {
-    if (!nested) {
-        pthread_rwlock_unlock(&lock);
+void unlock_inodes(const int* inode_ids, int n) {
+    int wanted[N_LOCK_STRIPES];
+    collect_stripes(inode_ids, NULL, n, wanted);
+    for (int stripe = N_LOCK_STRIPES - 1; stripe >= 0; --stripe) {
+        if (wanted[stripe] != -1) {
+            unlock_stripe(stripe);
+        }
     }
 }
@@ -1,11 +1,8 @@
 /* TO-DO:
-1. replace manual option parsing with getopt()
 2. indirect pointers in inodes
 3. make return values (void or return code) consistent
 4. block and entry iterators for an inode
 6. timestamps
-7. separate network messaging between data socket and sync socket
-8. wait for epoll notification instead of spinning
 */
 
 #include <stdio.h>
@@ -21,7 +18,10 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <pthread.h>
+#include <signal.h>
+#include <getopt.h>
 
 #include "globals.h"
 #include "bit_util.h"
@@ -31,6 +31,16 @@
 #include "interface.h"
 #include "disk_io.h"
 #include "net_io.h"
+#include "meta_cache.h"
+#include "worker_pool.h"
+#include "reactor.h"
+#include "protocol.h"
+#include "transfer.h"
+#include "batch.h"
+#include "shm_session.h"
+#include "lease.h"
+#include "query.h"
+#include "compress.h"
 
 int disk_fd;
 _Thread_local int nested;
@@ -75,7 +85,7 @@ void create_root_dir() {
     inode.last_modified = time(NULL);
     inode.user_id       = 0;
     memset(inode.direct, -1, sizeof(inode.direct));
-    allocate_inode(); // will return 0
+    allocate_inode_near(ROOT_INODE_ID); // will return 0
     init_dir(&inode, 0, 0);
     write_inode(&inode, 0);
 }
@@ -100,10 +110,15 @@ void create_disk(const char* path) {
         .n_free_inodes = N_INODES
     };
     write_superblock(&sb);
+    init_block_allocator();
+    init_inode_allocator();
     create_root_dir();
 }
 
-int setup_server(int port) {
+#define DEFAULT_PORT    8080
+#define DEFAULT_BACKLOG 128
+
+int setup_server(int port, int backlog) {
     int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (sock_fd < 0) {
         log_msg("couldn't create socket");
@@ -112,6 +127,7 @@ int setup_server(int port) {
     if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0) {
         log_msg("setsockopt error");
     }
+    tune_socket(sock_fd);
     struct sockaddr_in serv_addr, client_addr;
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_port = htons(port);
@@ -120,77 +136,516 @@ int setup_server(int port) {
         log_msg("bind error");
         exit(1);
     }
-    listen(sock_fd, 1);
+    listen(sock_fd, backlog);
     return sock_fd;
 }
 
-void* process_client(void* new_client_fd) {
-    client_fd = *((int*)(new_client_fd));
-    free((int*)new_client_fd);
-    work_inode_id = ROOT_INODE_ID;
-    nested = 0;
+// for clients on the same host, which don't need to go through TCP
+int setup_local_server(const char* path, int backlog) {
+    int sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock_fd < 0) {
+        log_msg("couldn't create local socket");
+        exit(1);
+    }
+    tune_socket(sock_fd);
+    struct sockaddr_un serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(serv_addr.sun_path)) {
+        log_msg("local socket path too long");
+        exit(1);
+    }
+    strcpy(serv_addr.sun_path, path);
+    // left over from a previous run
+    unlink(path);
+    if (bind(sock_fd, (struct sockaddr*)(&serv_addr), sizeof(serv_addr)) < 0) {
+        log_msg("local bind error");
+        exit(1);
+    }
+    listen(sock_fd, backlog);
+    return sock_fd;
+}
+
+void* accept_connections(void* arg) {
+    int sock_fd = *(int*)arg;
+    while (1) {
+        int new_client_fd = accept(sock_fd, NULL, NULL);
+        if (new_client_fd < 0) {
+            continue;
+        }
+        tune_socket(new_client_fd);
+        reactor_add_connection(new_client_fd);
+    }
+    return NULL;
+}
+
+// ls [--all|-a] [--long|-l] [path]
+// readdir [--all|-a] [--long|-l] [--cursor B:S] [--count N] [path]
+void process_listing(enum opcode opcode, char** args) {
+    int all = 0, long_format = 0;
+    struct dir_cursor cursor = DIR_CURSOR_START;
+    int max_entries = READDIR_BATCH_SIZE;
+    char** arg;
+    for (arg = args; *arg != NULL && (*arg)[0] == '-'; ++arg) {
+        if (strcmp(*arg, "--all") == 0 || strcmp(*arg, "-a") == 0) {
+            all = 1;
+        } else if (strcmp(*arg, "--long") == 0 || strcmp(*arg, "-l") == 0) {
+            long_format = 1;
+        } else if (strcmp(*arg, "--cursor") == 0 && *(arg + 1) != NULL) {
+            if (sscanf(*++arg, "%d:%d", &cursor.block_idx, &cursor.slot) != 2) {
+                send_failure("invalid cursor\n");
+                return;
+            }
+        } else if (strcmp(*arg, "--count") == 0 && *(arg + 1) != NULL) {
+            max_entries = atoi(*++arg);
+        } else {
+            send_failure("unknown option\n");
+            return;
+        }
+    }
+    if (opcode == OP_LS) {
+        list_entries(*arg, all, long_format);
+    } else {
+        read_dir(*arg, all, long_format, cursor, max_entries);
+    }
+}
+
+// [+-]N
+static int parse_cmp(const char* arg, struct query_cmp* cmp) {
+    cmp->op = (arg[0] == '+' || arg[0] == '-' ? arg[0] : '=');
+    char* end;
+    cmp->value = strtoll(arg + (cmp->op != '='), &end, 10);
+    return (*end == '\0' && end != arg + (cmp->op != '=') ? 0 : -1);
+}
+
+// du [--summarize] [--parallel N] [path]
+// find [--name pattern] [--type f|d] [--size [+-]N] [--mtime [+-]N] [--parallel N] [path]
+void process_query(enum opcode opcode, char** args) {
+    int summarize = 0, n_threads = 1;
+    struct find_filter filter = { 0 };
+    char** arg;
+    for (arg = args; *arg != NULL && strncmp(*arg, "--", 2) == 0; ++arg) {
+        if (strcmp(*arg, "--parallel") == 0 && *(arg + 1) != NULL) {
+            n_threads = atoi(*++arg);
+        } else if (opcode == OP_DU && strcmp(*arg, "--summarize") == 0) {
+            summarize = 1;
+        } else if (opcode == OP_FIND && strcmp(*arg, "--name") == 0 && *(arg + 1) != NULL) {
+            filter.name = *++arg;
+        } else if (opcode == OP_FIND && strcmp(*arg, "--type") == 0 && *(arg + 1) != NULL
+                   && (strcmp(*(arg + 1), "f") == 0 || strcmp(*(arg + 1), "d") == 0)) {
+            filter.type = **++arg;
+        } else if (opcode == OP_FIND && strcmp(*arg, "--size") == 0 && *(arg + 1) != NULL
+                   && parse_cmp(*(arg + 1), &filter.size) == 0) {
+            ++arg;
+        } else if (opcode == OP_FIND && strcmp(*arg, "--mtime") == 0 && *(arg + 1) != NULL
+                   && parse_cmp(*(arg + 1), &filter.mtime) == 0) {
+            ++arg;
+        } else {
+            send_failure("unknown option\n");
+            return;
+        }
+    }
+    if (opcode == OP_DU) {
+        disk_usage(*arg, summarize, n_threads);
+    } else {
+        find_files(*arg, &filter, n_threads);
+    }
+}
 
-    char buf[1024];
-    // log in
-    recv_msg(buf);
-    user_id = atoi(buf);
+// number of tokens in a split payload
+static int count_args(char** args) {
+    int n = 0;
+    while (args[n] != NULL) {
+        ++n;
+    }
+    return n;
+}
+
+// the transfer itself happens once a data connection presents the ticket
+void open_data_transfer(enum opcode opcode, const char* payload) {
+    struct transfer transfer = {
+        .opcode        = (opcode == OP_OPEN_UPLOAD ? OP_UPLOAD : OP_DOWNLOAD),
+        .user_id       = user_id,
+        .work_inode_id = work_inode_id
+    };
+    snprintf(transfer.args, sizeof(transfer.args), "%s", payload);
+    char ticket[TICKET_LEN];
+    if (open_transfer(&transfer, ticket) == -1) {
+        send_failure("too many pending transfers\n");
+        return;
+    }
+    send_success();
+    send_msg(ticket);
+}
+
+static void abandon_upload_range(struct transfer* transfer) {
+    finish_upload_range(transfer->upload, 0);
+}
+
+// the file is split into at most n_streams runs of whole blocks, each with a ticket of its own
+void open_parallel_transfer(enum opcode opcode, char** args, int n_args) {
+    int is_upload = (opcode == OP_OPEN_PARALLEL_UPLOAD);
+    if (n_args < (is_upload ? 3 : 2)) {
+        send_failure("missing operand\n");
+        return;
+    }
+    long long size = (is_upload ? strtoll(args[1], NULL, 10) : get_file_size(args[0]));
+    if (size < 0) {
+        if (is_upload) {
+            send_failure("invalid size\n");
+        }
+        return;
+    }
+    int n_streams = atoi(args[n_args - 1]);
+    int n_blocks = (size > 0 ? get_n_blocks_needed(size) : 1);
+    n_streams = (n_streams < 1 ? 1 : n_streams > MAX_TRANSFER_STREAMS ? MAX_TRANSFER_STREAMS : n_streams);
+    int range_blocks = (n_blocks + n_streams - 1) / n_streams;
+    int n_ranges = (n_blocks + range_blocks - 1) / range_blocks;
+    size_t range_len = (size_t)range_blocks * MINIFS_BLOCK_SIZE;
+
+    // abandoned uploads may be holding on to the blocks this one needs
+    expire_transfers();
+    struct staged_upload* upload = NULL;
+    if (is_upload && (upload = stage_upload(args[0], size, n_ranges)) == NULL) {
+        return;
+    }
+    struct strbuf* reply = get_reply_buf();
+    char tickets[MAX_TRANSFER_STREAMS][TICKET_LEN];
+    int n_opened;
+    for (n_opened = 0; n_opened < n_ranges; ++n_opened) {
+        size_t offset = n_opened * range_len;
+        size_t len = (size - offset < range_len ? size - offset : range_len);
+        struct transfer transfer = {
+            .user_id       = user_id,
+            .work_inode_id = work_inode_id
+        };
+        if (is_upload) {
+            transfer.opcode  = OP_DATA;
+            transfer.upload  = upload;
+            transfer.offset  = offset;
+            transfer.len     = len;
+            transfer.abandon = abandon_upload_range;
+        } else {
+            transfer.opcode = OP_READ;
+            snprintf(transfer.args, sizeof(transfer.args), "%s %zu %zu", args[0], offset, len);
+        }
+        if (open_transfer(&transfer, tickets[n_opened]) == -1) {
+            break;
+        }
+        strbuf_appendf(reply, "%zu %zu %s\n", offset, len, tickets[n_opened]);
+    }
+    if (n_opened < n_ranges) {
+        // none of it happens then
+        struct transfer transfer;
+        for (int i = 0; i < n_opened; ++i) {
+            claim_transfer(tickets[i], &transfer);
+        }
+        for (int i = 0; is_upload && i < n_ranges; ++i) {
+            finish_upload_range(upload, 0);
+        }
+        send_failure("too many pending transfers\n");
+        return;
+    }
     send_success();
+    send_nbytes(reply->data, reply->len);
+}
+
+void run_command(struct conn* conn, enum opcode opcode, const char* payload);
+
+// a data connection carries out one transfer in the name of the session that opened it
+void attach_data_connection(struct conn* conn, const char* ticket) {
+    conn->state = CONN_CLOSING;
+    struct transfer transfer;
+    if (claim_transfer(ticket, &transfer) == -1) {
+        send_failure("invalid or expired ticket\n");
+        return;
+    }
+    user_id       = transfer.user_id;
+    work_inode_id = transfer.work_inode_id;
+    if (transfer.upload != NULL) {
+        // everything was checked when the ticket was handed out, so the data follows it right away
+        int received = (recv_upload_range(transfer.upload, transfer.offset, transfer.len) == 0);
+        finish_upload_range(transfer.upload, received);
+        return;
+    }
+    run_command(conn, transfer.opcode, transfer.args);
+}
+
+// the header line is split off, the contents may hold anything
+void process_put(struct request* request) {
+    char* contents = memchr(request->payload, '\n', request->header.payload_len);
+    if (contents == NULL) {
+        send_failure("missing operand\n");
+        return;
+    }
+    *contents++ = '\0';
+    size_t size = request->header.payload_len - (contents - request->payload);
+    char** args = split_str(request->payload, " ");
+    printf("got request %u: put %s\n", request->header.request_id, request->payload);
+    if (count_args(args) < 2) {
+        send_failure("missing operand\n");
+    } else if (!(request->header.flags & REQUEST_COMPRESSED)) {
+        if (strtoull(args[1], NULL, 10) != size) {
+            send_failure("size doesn't match the contents\n");
+        } else {
+            put_file(args[0], contents, size);
+        }
+    } else {
+        struct strbuf data;
+        strbuf_init(&data);
+        if (decompress_stream(contents, size, &data, MAX_FILE_SIZE) == -1
+            || strtoull(args[1], NULL, 10) != data.len) {
+            send_failure("corrupt compressed data\n");
+        } else {
+            put_file(args[0], data.data, data.len);
+        }
+        strbuf_free(&data);
+    }
+    free_tokens(args);
+}
+
+// one request from a connection, already read by the reactor
+void process_request(struct request* request) {
+    struct conn* conn = request->conn;
+    // shared-memory sessions have no socket to send revocations to
+    int leased = (request->header.flags & REQUEST_LEASE) && conn->fd != -1 && conn->state == CONN_OPEN
+                 && (request->header.opcode == OP_LS || request->header.opcode == OP_READDIR);
+    set_lease_holder(leased ? conn : NULL, request->header.request_id);
+    if (conn->state == CONN_LOGIN) {
+        if (request->header.opcode == OP_ATTACH) {
+            attach_data_connection(conn, request->payload);
+            return;
+        }
+        if (request->header.opcode != OP_LOGIN) {
+            send_failure("log in first\n");
+            return;
+        }
+        user_id = atoi(request->payload);
+        send_success();
+        if ((request->header.flags & REQUEST_COMPRESS) && net_options.compress) {
+            add_reply_flags(RESPONSE_COMPRESSED);
+        }
+        conn->state = CONN_OPEN;
+        return;
+    }
+
+    if (request->header.opcode == OP_BATCH) {
+        printf("got request %u: batch of %u bytes\n", request->header.request_id, request->header.payload_len);
+        run_batch(request->payload, request->header.flags & REQUEST_ATOMIC);
+        return;
+    }
+    if (request->header.opcode == OP_PUT) {
+        process_put(request);
+        return;
+    }
+    printf("got request %u: %d %s\n", request->header.request_id, request->header.opcode, request->payload);
+    run_command(conn, request->header.opcode, request->payload);
+}
 
-    while (recv_msg(buf) > 0) {
-        printf("got msg: %s\n", buf);
-        char** tokens = split_str(buf, " ");
+void run_command(struct conn* conn, enum opcode opcode, const char* payload) {
+    char** args = split_str(payload, " ");
+    int n_args = count_args(args);
 
-        if (strcmp(tokens[0], "exit") == 0) {
-            free_tokens(tokens);
-            return NULL;
-        } else if (strcmp(tokens[0], "help") == 0) {
+    switch (opcode) {
+        case OP_EXIT:
+            conn->state = CONN_CLOSING;
+            break;
+        case OP_HELP:
             display_help();
-        } else if (strcmp(tokens[0], "pwd") == 0) {
+            break;
+        case OP_PWD:
             print_work_path();
-        } else if (strcmp(tokens[0], "cd") == 0) {
-            change_dir(tokens[1]);
-        } else if (strcmp(tokens[0], "ls") == 0) {
-            if (tokens[1] != NULL && strcmp(tokens[1], "--all") == 0) {
-                list_entries(tokens[2], 1);
-            } else {
-                list_entries(tokens[1], 0);
+            break;
+        case OP_CD:
+            if (n_args < 1) {
+                send_failure("missing operand\n");
+                break;
             }
-        } else if (strcmp(tokens[0], "cp") == 0) {
-            if (strcmp(tokens[1], "--from-local") == 0) {
-                copy_from_local(tokens[3]);
-            } else if (strcmp(tokens[1], "--to-local") == 0) {
-                copy_to_local(tokens[2]);
-            } else {
-                copy(tokens[1], tokens[2]);
+            change_dir(args[0]);
+            break;
+        case OP_LS:
+        case OP_READDIR:
+            process_listing(opcode, args);
+            break;
+        case OP_DU:
+        case OP_FIND:
+            process_query(opcode, args);
+            break;
+        case OP_STAT:
+            stat_files(args, n_args);
+            break;
+        case OP_COPY:
+            if (n_args < 2) {
+                send_failure("missing operand\n");
+                break;
             }
-        } else if (strcmp(tokens[0], "rm") == 0) {
-            remove(tokens[1]);
-        } else if (strcmp(tokens[0], "mv") == 0) {
-            move(tokens[1], tokens[2]);
-        } else if (strcmp(tokens[0], "mkdir") == 0) {
-            create_file(tokens[1], DIRECTORY);
-        } else if (strcmp(tokens[0], "touch") == 0) {
-            create_file(tokens[1], REGULAR_FILE);
-        } else if (strcmp(tokens[0], "cat") == 0) {
-            print_contents(tokens[1]);
-        } else {
+            if (strcmp(args[0], "-r") == 0) {
+                if (n_args < 3) {
+                    send_failure("missing operand\n");
+                    break;
+                }
+                copy_tree(args[1], args[2]);
+                break;
+            }
+            copy(args[0], args[1]);
+            break;
+        case OP_UPLOAD:
+            if (n_args < 2) {
+                send_failure("missing operand\n");
+                break;
+            }
+            copy_from_local(args[0], strtoull(args[1], NULL, 10));
+            break;
+        case OP_DOWNLOAD:
+            if (n_args < 1) {
+                send_failure("missing operand\n");
+                break;
+            }
+            copy_to_local(args[0]);
+            break;
+        case OP_REMOVE:
+            if (n_args < 1) {
+                send_failure("missing operand\n");
+                break;
+            }
+            remove(args[0]);
+            break;
+        case OP_MOVE:
+            if (n_args < 2) {
+                send_failure("missing operand\n");
+                break;
+            }
+            move(args[0], args[1]);
+            break;
+        case OP_MKDIR:
+            if (n_args < 1) {
+                send_failure("missing operand\n");
+                break;
+            }
+            create_file(args[0], DIRECTORY);
+            break;
+        case OP_TOUCH:
+            if (n_args < 1) {
+                send_failure("missing operand\n");
+                break;
+            }
+            create_file(args[0], REGULAR_FILE);
+            break;
+        case OP_CAT:
+            if (n_args < 1) {
+                send_failure("missing operand\n");
+                break;
+            }
+            print_contents(args[0]);
+            break;
+        case OP_OPEN_UPLOAD:
+        case OP_OPEN_DOWNLOAD:
+            open_data_transfer(opcode, payload);
+            break;
+        case OP_READ:
+            if (n_args < 3) {
+                send_failure("missing operand\n");
+                break;
+            }
+            read_range(args[0], strtoll(args[1], NULL, 10), strtoll(args[2], NULL, 10));
+            break;
+        case OP_WRITE:
+            if (n_args < 3) {
+                send_failure("missing operand\n");
+                break;
+            }
+            write_range(args[0], strtoll(args[1], NULL, 10), strtoll(args[2], NULL, 10));
+            break;
+        case OP_TRUNCATE:
+            if (n_args < 2) {
+                send_failure("missing operand\n");
+                break;
+            }
+            truncate_file(args[0], strtoll(args[1], NULL, 10));
+            break;
+        case OP_OPEN_PARALLEL_UPLOAD:
+        case OP_OPEN_PARALLEL_DOWNLOAD:
+            open_parallel_transfer(opcode, args, n_args);
+            break;
+        case OP_OPEN_SHM:
+            open_shm_session(conn, process_request);
+            break;
+        default:
             send_failure("unknown command; type 'help' for help\n");
-        }
-        free_tokens(tokens);
     }
-    return NULL;
+    free_tokens(args);
+}
+
+void print_usage(const char* name) {
+    fprintf(stderr,
+        "usage: %s [options] [port]\n"
+        "  -p port       port to listen on (default %d)\n"
+        "  -u path       also listen on a local socket at path, which offers shared memory as well\n"
+        "  -w workers    number of worker threads (default %d)\n"
+        "  -e loops      number of event loop threads watching the sockets (default %d)\n"
+        "  -b backlog    listen backlog (default %d)\n"
+        "  -q capacity   received requests waiting for a worker (default %d)\n"
+        "  -c bytes      chunk size for file data copied through the server (default %d)\n"
+        "  -s bytes      socket send buffer size (default: the system's)\n"
+        "  -r bytes      socket receive buffer size (default: the system's)\n"
+        "  -n 0|1        TCP_NODELAY, send small replies right away (default 1)\n"
+        "  -k 0|1        TCP_CORK around replies sent in several parts (default 1)\n"
+        "  -z 0|1        compress file data for clients that ask for it (default 1)\n",
+        name, DEFAULT_PORT, DEFAULT_N_WORKERS, DEFAULT_N_EVENT_LOOPS, DEFAULT_BACKLOG, DEFAULT_QUEUE_CAPACITY,
+        DEFAULT_CHUNK_SIZE);
 }
 
 int main(int argc, char** argv) {
+    int port = DEFAULT_PORT;
+    int n_workers = DEFAULT_N_WORKERS;
+    int n_event_loops = DEFAULT_N_EVENT_LOOPS;
+    int backlog = DEFAULT_BACKLOG;
+    int queue_capacity = DEFAULT_QUEUE_CAPACITY;
+    const char* local_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:u:w:e:b:q:c:s:r:n:k:z:")) != -1) {
+        switch (opt) {
+            case 'p': port = atoi(optarg); break;
+            case 'u': local_path = optarg; break;
+            case 'w': n_workers = atoi(optarg); break;
+            case 'e': n_event_loops = atoi(optarg); break;
+            case 'b': backlog = atoi(optarg); break;
+            case 'q': queue_capacity = atoi(optarg); break;
+            case 'c': net_options.chunk_size = atoi(optarg); break;
+            case 's': net_options.sndbuf = atoi(optarg); break;
+            case 'r': net_options.rcvbuf = atoi(optarg); break;
+            case 'n': net_options.nodelay = (atoi(optarg) != 0); break;
+            case 'k': net_options.cork = (atoi(optarg) != 0); break;
+            case 'z': net_options.compress = (atoi(optarg) != 0); break;
+            default:
+                print_usage(argv[0]);
+                exit(1);
+        }
+    }
+    // the port used to be the only (positional) argument
+    if (optind < argc) {
+        port = atoi(argv[optind]);
+    }
+    if (n_workers <= 0 || n_event_loops <= 0 || backlog <= 0 || queue_capacity <= 0
+        || net_options.chunk_size <= 0 || net_options.sndbuf < 0 || net_options.rcvbuf < 0) {
+        print_usage(argv[0]);
+        exit(1);
+    }
+
     daemonize();
     log_fp = fopen("log", "w+");
+    // a client hanging up mid-reply must not take the server down
+    signal(SIGPIPE, SIG_IGN);
     create_disk("/dev/minifs");
-    int sock_fd = setup_server(argc >= 2 ? atoi(argv[1]) : 8080);
-    while (1) {
-        int* new_client_fd = malloc(sizeof(int));
-        *new_client_fd = accept(sock_fd, NULL, NULL);
+    meta_cache_init();
+    int sock_fd = setup_server(port, backlog);
+    int local_sock_fd = (local_path == NULL ? -1 : setup_local_server(local_path, backlog));
+    start_reactor(n_event_loops, n_workers, queue_capacity, process_request);
+    if (local_sock_fd != -1) {
         pthread_t thread;
-        pthread_create(&thread, NULL, process_client, new_client_fd);
+        pthread_create(&thread, NULL, accept_connections, &local_sock_fd);
+        pthread_detach(thread);
     }
+    accept_connections(&sock_fd);
     close(disk_fd);
 }
@@ -0,0 +1,173 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "meta_cache.h"
+#include "block.h"
+#include "epoch.h"
+#include "lock.h"
+#include "lease.h"
+
+static _Atomic(struct inode*) inode_versions[N_INODES];
+static _Atomic(struct dir_snapshot*) dir_snapshots[N_INODES];
+
+#define HELD_INODE 0x1
+#define HELD_DIR   0x2
+
+// the versions published while holding, private to the thread; a held snapshot is NULL
+// if the directory's was dropped, and is built again the next time it's needed
+static _Thread_local struct {
+    int                  holding;
+    char                 held[N_INODES];
+    struct inode*        inode_versions[N_INODES];
+    struct dir_snapshot* dir_snapshots[N_INODES];
+} held;
+
+void meta_cache_init() {
+    for (int i = 0; i < N_INODES; ++i) {
+        struct inode* inode = malloc(sizeof(struct inode));
+        read_data(inode, sizeof(struct inode), get_inode_offset(i));
+        epoch_retire(atomic_exchange(inode_versions + i, inode));
+        drop_dir_snapshot(i);
+    }
+}
+
+int cached_read_inode(struct inode* inode, int inode_id) {
+    if (held.holding && (held.held[inode_id] & HELD_INODE)) {
+        *inode = *held.inode_versions[inode_id];
+        return 0;
+    }
+    epoch_enter();
+    struct inode* version = atomic_load_explicit(inode_versions + inode_id, memory_order_acquire);
+    if (version != NULL) {
+        *inode = *version;
+    }
+    epoch_exit();
+    return (version == NULL ? -1 : 0);
+}
+
+void cached_read_inodes(const int* inode_ids, int n, struct inode* inodes, char* found) {
+    epoch_enter();
+    for (int i = 0; i < n; ++i) {
+        struct inode* version = atomic_load_explicit(inode_versions + inode_ids[i], memory_order_acquire);
+        if (held.holding && (held.held[inode_ids[i]] & HELD_INODE)) {
+            version = held.inode_versions[inode_ids[i]];
+        }
+        found[i] = (version != NULL);
+        if (version != NULL) {
+            inodes[i] = *version;
+        }
+    }
+    epoch_exit();
+}
+
+void publish_inode(const struct inode* inode, int inode_id) {
+    struct inode* version = malloc(sizeof(struct inode));
+    *version = *inode;
+    if (held.holding) {
+        free(held.inode_versions[inode_id]);
+        held.inode_versions[inode_id] = version;
+        held.held[inode_id] |= HELD_INODE;
+        return;
+    }
+    epoch_retire(atomic_exchange_explicit(inode_versions + inode_id, version, memory_order_acq_rel));
+    revoke_leases(inode_id);
+}
+
+static struct dir_snapshot* build_dir_snapshot(int dir_inode_id) {
+    struct inode dir_inode;
+    read_inode(&dir_inode, dir_inode_id);
+    if (dir_inode.file_type != DIRECTORY) {
+        return NULL;
+    }
+    int n_blocks = 0;
+    for (int i = 0; i < N_DIRECT_PTRS; ++i) {
+        n_blocks += is_correct_block_id(dir_inode.direct[i]);
+    }
+    struct dir_snapshot* snapshot = malloc(sizeof(struct dir_snapshot) + n_blocks * MINIFS_BLOCK_SIZE);
+    snapshot->n_blocks = 0;
+    for (int i = 0; i < N_DIRECT_PTRS; ++i) {
+        if (is_correct_block_id(dir_inode.direct[i])) {
+            snapshot->direct_idx[snapshot->n_blocks] = i;
+            read_block(snapshot->blocks[snapshot->n_blocks], dir_inode.direct[i]);
+            ++snapshot->n_blocks;
+        }
+    }
+    return snapshot;
+}
+
+const struct dir_snapshot* get_dir_snapshot(int dir_inode_id) {
+    if (!is_allocated_inode_id(dir_inode_id)) {
+        return NULL;
+    }
+    if (held.holding && (held.held[dir_inode_id] & HELD_DIR)) {
+        // every lock is held, there's nobody to keep out
+        if (held.dir_snapshots[dir_inode_id] == NULL) {
+            held.dir_snapshots[dir_inode_id] = build_dir_snapshot(dir_inode_id);
+        }
+        return held.dir_snapshots[dir_inode_id];
+    }
+    struct dir_snapshot* snapshot = atomic_load_explicit(dir_snapshots + dir_inode_id, memory_order_acquire);
+    if (snapshot != NULL) {
+        return snapshot;
+    }
+    // first access since the directory was created: build it while writers are kept out,
+    // and give way if one of them has published in the meantime
+    lock_inode(dir_inode_id, LOCK_READ);
+    struct dir_snapshot* built = build_dir_snapshot(dir_inode_id);
+    if (built != NULL && !atomic_compare_exchange_strong(dir_snapshots + dir_inode_id, &snapshot, built)) {
+        free(built);
+        built = snapshot;
+    }
+    unlock_inode(dir_inode_id);
+    return built;
+}
+
+static void hold_dir_snapshot(int dir_inode_id, struct dir_snapshot* snapshot) {
+    free(held.dir_snapshots[dir_inode_id]);
+    held.dir_snapshots[dir_inode_id] = snapshot;
+    held.held[dir_inode_id] |= HELD_DIR;
+}
+
+void publish_dir_snapshot(int dir_inode_id) {
+    if (held.holding) {
+        hold_dir_snapshot(dir_inode_id, build_dir_snapshot(dir_inode_id));
+        return;
+    }
+    epoch_retire(atomic_exchange(dir_snapshots + dir_inode_id, build_dir_snapshot(dir_inode_id)));
+    revoke_leases(dir_inode_id);
+}
+
+void drop_dir_snapshot(int dir_inode_id) {
+    if (held.holding) {
+        hold_dir_snapshot(dir_inode_id, NULL);
+        return;
+    }
+    epoch_retire(atomic_exchange(dir_snapshots + dir_inode_id, NULL));
+    revoke_leases(dir_inode_id);
+}
+
+void meta_cache_hold() {
+    held.holding = 1;
+    hold_inode_bitmap();
+}
+
+void meta_cache_publish_held() {
+    held.holding = 1;
+    for (int i = 0; i < N_INODES; ++i) {
+        if (held.held[i] & HELD_INODE) {
+            epoch_retire(atomic_exchange_explicit(inode_versions + i, held.inode_versions[i], memory_order_acq_rel));
+        }
+        if (held.held[i] & HELD_DIR) {
+            epoch_retire(atomic_exchange(dir_snapshots + i, held.dir_snapshots[i]));
+        }
+        if (held.held[i] != 0) {
+            revoke_leases(i);
+        }
+        held.held[i] = 0;
+        held.inode_versions[i] = NULL;
+        held.dir_snapshots[i] = NULL;
+    }
+    // last, so that what the batch created appears at once, in the directories published by now
+    publish_inode_bitmap();
+}
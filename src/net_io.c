@@ -1,12 +1,111 @@
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include "globals.h"
 #include "net_io.h"
+#include "str_util.h"
+#include "disk_io.h"
+#include "compress.h"
+#include "lease.h"
+
+struct net_options net_options = {
+    .chunk_size = DEFAULT_CHUNK_SIZE,
+    .nodelay    = 1,
+    .cork       = 1,
+    .compress   = 1
+};
+
+void tune_socket(int fd) {
+    if (net_options.sndbuf > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &net_options.sndbuf, sizeof(int));
+    }
+    if (net_options.rcvbuf > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &net_options.rcvbuf, sizeof(int));
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &net_options.nodelay, sizeof(int));
+}
+
+// set for shared-memory sessions
+static _Thread_local struct shm_channel* channel;
+
+void set_shm_channel(struct shm_channel* new_channel) {
+    channel = new_channel;
+}
+
+static void set_cork(int on) {
+    if (net_options.cork && channel == NULL) {
+        setsockopt(client_fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(int));
+    }
+}
+
+// scratch space of net_options.chunk_size bytes for moving file data through userspace
+static char* get_chunk_buf() {
+    static _Thread_local char* chunk_buf;
+    if (chunk_buf == NULL) {
+        chunk_buf = malloc(net_options.chunk_size);
+    }
+    return chunk_buf;
+}
+
+// the response being built for the request this thread is serving;
+// it goes out as a single message once the handler is done (or flush_reply() is called)
+static _Thread_local struct {
+    struct msg_header header;
+    int               pending;
+    struct strbuf     payload;
+    pthread_mutex_t*  send_mutex;
+    int               compress; // file contents, see send_disk_ranges()
+} reply;
+
+static int send_all(const void* buf, int n, int flags) {
+    if (channel != NULL) {
+        return shm_send(channel, buf, n);
+    }
+    const char* ptr = buf;
+    while (n > 0) {
+        ssize_t sent = send(client_fd, ptr, n, flags);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ptr += sent;
+        n -= sent;
+    }
+    return 0;
+}
+
+void set_current_request(const struct msg_header* request, pthread_mutex_t* send_mutex) {
+    reply.send_mutex        = send_mutex;
+    reply.header.opcode     = request->opcode;
+    reply.header.flags      = 0;
+    reply.header.request_id = request->request_id;
+    reply.compress = net_options.compress && (request->flags & REQUEST_COMPRESS);
+    reply.pending = 0;
+    strbuf_reset(&reply.payload);
+}
+
+static void start_reply(enum status status) {
+    reply.header.status = status;
+    reply.pending = 1;
+    strbuf_reset(&reply.payload);
+}
 
 void send_nbytes(const void* buf, int n) {
-    send(client_fd, buf, n, 0);
+    strbuf_append(&reply.payload, buf, n);
 }
 
 void send_msg(const char* buf) {
@@ -17,29 +116,321 @@ void send_success() {
     if (nested) {
         return;
     }
-    send_msg("1");
+    start_reply(STATUS_OK);
 }
 
 void send_failure(const char* msg) {
     if (nested) {
         return;
     }
-    send_msg("0");
+    start_reply(STATUS_ERROR);
     send_msg(msg);
 }
 
+void add_reply_flags(uint16_t flags) {
+    reply.header.flags |= flags;
+}
+
+int flush_reply() {
+    if (!reply.pending) {
+        return 0;
+    }
+    reply.pending = 0;
+    reply.header.payload_len = reply.payload.len;
+    unsigned char header[MSG_HEADER_SIZE];
+    encode_header(&reply.header, header);
+    pthread_mutex_lock(reply.send_mutex);
+    int result = send_all(header, sizeof(header), reply.payload.len > 0 ? MSG_MORE : 0);
+    if (result == 0 && reply.payload.len > 0) {
+        result = send_all(reply.payload.data, reply.payload.len, 0);
+    }
+    release_send_mutex(reply.send_mutex);
+    strbuf_reset(&reply.payload);
+    return result;
+}
+
+int flush_reply_with_fds(const int* fds, int n_fds) {
+    reply.pending = 0;
+    reply.header.payload_len = reply.payload.len;
+    unsigned char header[MSG_HEADER_SIZE];
+    encode_header(&reply.header, header);
+
+    // the fds ride along with the first byte of the header
+    char control[CMSG_SPACE(n_fds * sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { .iov_base = header, .iov_len = sizeof(header) };
+    struct msghdr msg = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = control,
+        .msg_controllen = sizeof(control)
+    };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(n_fds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, n_fds * sizeof(int));
+
+    pthread_mutex_lock(reply.send_mutex);
+    ssize_t sent;
+    do {
+        sent = sendmsg(client_fd, &msg, 0);
+    } while (sent < 0 && errno == EINTR);
+    int result = (sent < 0 ? -1 : send_all(header + sent, sizeof(header) - sent, 0));
+    if (result == 0 && reply.payload.len > 0) {
+        result = send_all(reply.payload.data, reply.payload.len, 0);
+    }
+    release_send_mutex(reply.send_mutex);
+    strbuf_reset(&reply.payload);
+    return result;
+}
+
+// set once sendfile() turns out not to work with the image, e.g. when it's a character device
+static atomic_int no_sendfile;
+
+static int send_disk_range_copying(off_t offset, size_t len) {
+    char* buf = get_chunk_buf();
+    while (len > 0) {
+        size_t n = (len < (size_t)net_options.chunk_size ? len : (size_t)net_options.chunk_size);
+        read_data(buf, n, offset);
+        if (send_all(buf, n, len > n ? MSG_MORE : 0) == -1) {
+            return -1;
+        }
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_disk_range(off_t offset, size_t len) {
+    while (len > 0 && !no_sendfile && channel == NULL) {
+        ssize_t sent = sendfile(client_fd, disk_fd, &offset, len);
+        if (sent > 0) {
+            len -= sent;
+        } else if (sent == 0) {
+            return -1; // the image is shorter than it should be
+        } else if (errno == EINVAL || errno == ENOSYS) {
+            no_sendfile = 1;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+    // sendfile() advanced offset past whatever it managed to send
+    return send_disk_range_copying(offset, len);
+}
+
+// the ranges go out compressed as a regular reply; 0 if that doesn't make them smaller and nothing is sent
+static int send_disk_ranges_compressed(const struct disk_range* ranges, int n_ranges, size_t payload_len) {
+    char* data = malloc(payload_len);
+    for (int i = 0, pos = 0; i < n_ranges; pos += ranges[i].len, ++i) {
+        read_data(data + pos, ranges[i].len, ranges[i].offset);
+    }
+    struct strbuf compressed;
+    strbuf_init(&compressed);
+    compress_stream(data, payload_len, &compressed);
+    free(data);
+    int result = 0;
+    if (compressed.len < payload_len) {
+        send_success();
+        add_reply_flags(RESPONSE_COMPRESSED);
+        send_nbytes(compressed.data, compressed.len);
+        result = (flush_reply() == 0 ? 1 : -1);
+    }
+    strbuf_free(&compressed);
+    return result;
+}
+
+int send_disk_ranges(const struct disk_range* ranges, int n_ranges) {
+    if (nested) {
+        return 0;
+    }
+    size_t payload_len = 0;
+    for (int i = 0; i < n_ranges; ++i) {
+        payload_len += ranges[i].len;
+    }
+    int sent_compressed = (reply.compress ? send_disk_ranges_compressed(ranges, n_ranges, payload_len) : 0);
+    if (sent_compressed != 0) {
+        return (sent_compressed == 1 ? 0 : -1);
+    }
+    struct msg_header header = reply.header;
+    header.status      = STATUS_OK;
+    header.payload_len = payload_len;
+    unsigned char header_buf[MSG_HEADER_SIZE];
+    encode_header(&header, header_buf);
+
+    // this replaces whatever reply was started
+    reply.pending = 0;
+    strbuf_reset(&reply.payload);
+
+    pthread_mutex_lock(reply.send_mutex);
+    // the header and the runs leave in as few segments as possible
+    set_cork(1);
+    int result = send_all(header_buf, sizeof(header_buf), payload_len > 0 ? MSG_MORE : 0);
+    for (int i = 0; i < n_ranges && result == 0; ++i) {
+        result = send_disk_range(ranges[i].offset, ranges[i].len);
+    }
+    set_cork(0);
+    release_send_mutex(reply.send_mutex);
+    if (result == -1) {
+        // the client can't tell where the reply ends anymore
+        shutdown(client_fd, SHUT_RDWR);
+    }
+    return result;
+}
+
+// set once splice() turns out not to work with the image
+static atomic_int no_splice;
+
+static int recv_disk_range_copying(off_t offset, size_t len) {
+    char* buf = get_chunk_buf();
+    while (len > 0) {
+        size_t n = (len < (size_t)net_options.chunk_size ? len : (size_t)net_options.chunk_size);
+        if (recv_nbytes(buf, n) == -1) {
+            return -1;
+        }
+        write_data(buf, n, offset);
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// the bytes already in the pipe go to the image the slow way
+static int drain_pipe_copying(int pipe_fd, off_t offset, size_t len) {
+    char* buf = get_chunk_buf();
+    while (len > 0) {
+        ssize_t n = read(pipe_fd, buf, (len < (size_t)net_options.chunk_size ? len : (size_t)net_options.chunk_size));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        write_data(buf, n, offset);
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int recv_disk_range(off_t offset, size_t len) {
+    // one pipe per worker, kept for the worker's lifetime
+    static _Thread_local int pipe_fds[2] = { -1, -1 };
+    if (pipe_fds[0] == -1 && !no_splice && channel == NULL) {
+        if (pipe(pipe_fds) == -1) {
+            pipe_fds[0] = pipe_fds[1] = -1;
+            return recv_disk_range_copying(offset, len);
+        }
+        // best effort, the default is 64 KiB
+        fcntl(pipe_fds[1], F_SETPIPE_SZ, net_options.chunk_size);
+    }
+    while (len > 0 && !no_splice && channel == NULL) {
+        // the socket may hand over less than asked for, and the pipe holds only so much
+        size_t n_wanted = (len < (size_t)net_options.chunk_size ? len : (size_t)net_options.chunk_size);
+        ssize_t in_pipe = splice(client_fd, NULL, pipe_fds[1], NULL, n_wanted, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in_pipe < 0 && errno == EINTR) {
+            continue;
+        }
+        if (in_pipe < 0 && errno == EINVAL) {
+            no_splice = 1;
+            break;
+        }
+        if (in_pipe <= 0) {
+            return -1;
+        }
+        size_t left_in_pipe = in_pipe;
+        while (left_in_pipe > 0) {
+            ssize_t written = (no_splice ? -1 : splice(pipe_fds[0], NULL, disk_fd, &offset, left_in_pipe, SPLICE_F_MOVE));
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                // most likely the image can't take it, e.g. a character device
+                no_splice = 1;
+                if (drain_pipe_copying(pipe_fds[0], offset, left_in_pipe) == -1) {
+                    return -1;
+                }
+                offset += left_in_pipe;
+                written = left_in_pipe;
+            }
+            left_in_pipe -= written;
+        }
+        len -= in_pipe;
+    }
+    return recv_disk_range_copying(offset, len);
+}
+
+int recv_disk_ranges(const struct disk_range* ranges, int n_ranges) {
+    for (int i = 0; i < n_ranges; ++i) {
+        if (recv_disk_range(ranges[i].offset, ranges[i].len) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int recv_compressed_disk_ranges(const struct disk_range* ranges, int n_ranges, size_t payload_len) {
+    size_t len = 0;
+    for (int i = 0; i < n_ranges; ++i) {
+        len += ranges[i].len;
+    }
+    char* payload = malloc(payload_len);
+    if (recv_nbytes(payload, payload_len) == -1) {
+        free(payload);
+        return -1;
+    }
+    struct strbuf data;
+    strbuf_init(&data);
+    int result = decompress_stream(payload, payload_len, &data, len);
+    free(payload);
+    if (result == 0 && data.len == len) {
+        for (int i = 0, pos = 0; i < n_ranges; pos += ranges[i].len, ++i) {
+            write_data(data.data + pos, ranges[i].len, ranges[i].offset);
+        }
+    } else {
+        send_failure("corrupt compressed data\n");
+        result = -1;
+    }
+    strbuf_free(&data);
+    return result;
+}
+
 int recv_nbytes(void* buf, int n) {
-    return recv(client_fd, buf, n, 0);
+    if (channel != NULL) {
+        return (shm_recv(channel, buf, n) == -1 ? -1 : n);
+    }
+    char* ptr = buf;
+    int n_left = n;
+    while (n_left > 0) {
+        ssize_t received = recv(client_fd, ptr, n_left, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return -1;
+        }
+        ptr += received;
+        n_left -= received;
+    }
+    return n;
+}
+
+int recv_header(struct msg_header* header) {
+    unsigned char buf[MSG_HEADER_SIZE];
+    if (recv_nbytes(buf, sizeof(buf)) == -1) {
+        return -1;
+    }
+    decode_header(buf, header);
+    return 0;
 }
 
-// to-do: fix this shit
-int recv_msg(char buf[MINIFS_BLOCK_SIZE]) {
-    memset(buf, 0, MINIFS_BLOCK_SIZE);
-    int bytes_read = recv(client_fd, buf, MINIFS_BLOCK_SIZE - 1, 0);
-    return bytes_read;
+void drop_connection() {
+    flush_reply();
+    shutdown(channel != NULL ? channel->hangup_fd : client_fd, SHUT_RDWR);
 }
 
-void discard_msg() {
-    char buf[MINIFS_BLOCK_SIZE];
-    while (recv_msg(buf) > 0) {};
+struct strbuf* get_reply_buf() {
+    static _Thread_local struct strbuf reply_buf;
+    strbuf_reset(&reply_buf);
+    return &reply_buf;
 }
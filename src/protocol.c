@@ -0,0 +1,39 @@
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+
+void encode_header(const struct msg_header* header, unsigned char out[MSG_HEADER_SIZE]) {
+    uint16_t flags       = htons(header->flags);
+    uint32_t request_id  = htonl(header->request_id);
+    uint32_t payload_len = htonl(header->payload_len);
+    out[0] = header->opcode;
+    out[1] = header->status;
+    memcpy(out + 2, &flags, sizeof(flags));
+    memcpy(out + 4, &request_id, sizeof(request_id));
+    memcpy(out + 8, &payload_len, sizeof(payload_len));
+}
+
+void decode_header(const unsigned char in[MSG_HEADER_SIZE], struct msg_header* header) {
+    uint16_t flags;
+    uint32_t request_id, payload_len;
+    memcpy(&flags, in + 2, sizeof(flags));
+    memcpy(&request_id, in + 4, sizeof(request_id));
+    memcpy(&payload_len, in + 8, sizeof(payload_len));
+    header->opcode      = in[0];
+    header->status      = in[1];
+    header->flags       = ntohs(flags);
+    header->request_id  = ntohl(request_id);
+    header->payload_len = ntohl(payload_len);
+}
+
+uint32_t max_request_payload(uint8_t opcode) {
+    switch (opcode) {
+        case OP_BATCH:
+            return MAX_BATCH_PAYLOAD;
+        case OP_PUT:
+            return MAX_REQUEST_PAYLOAD + MAX_FILE_SIZE;
+        default:
+            return MAX_REQUEST_PAYLOAD;
+    }
+}
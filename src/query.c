@@ -0,0 +1,246 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "query.h"
+#include "globals.h"
+#include "block.h"
+#include "inode.h"
+#include "interface.h"
+#include "net_io.h"
+#include "str_util.h"
+
+struct query {
+    int                       du;
+    int                       summarize;
+    const struct find_filter* filter;
+    time_t                    now;
+    int                       user_id; // for the threads helping us, see check_user_id()
+};
+
+static char* join_path(const char* dir, const char* name) {
+    char* path = malloc(strlen(dir) + strlen(name) + 2);
+    size_t len = strlen(dir);
+    sprintf(path, "%s%s%s", dir, (len > 0 && dir[len - 1] == '/' ? "" : "/"), name);
+    return path;
+}
+
+static int compare(const struct query_cmp* cmp, long long value) {
+    switch (cmp->op) {
+        case '+':
+            return value > cmp->value;
+        case '-':
+            return value < cmp->value;
+        case '=':
+            return value == cmp->value;
+        default:
+            return 1;
+    }
+}
+
+static int matches(const struct query* query, const struct inode* inode, const char* name) {
+    const struct find_filter* filter = query->filter;
+    if (filter->name != NULL && fnmatch(filter->name, name, 0) != 0) {
+        return 0;
+    }
+    if (filter->type != 0 && filter->type != (inode->file_type == DIRECTORY ? 'd' : 'f')) {
+        return 0;
+    }
+    return compare(&filter->size, inode->size)
+           && compare(&filter->mtime, (query->now - inode->last_modified) / (24 * 60 * 60));
+}
+
+// the entries of a directory the user may see, without . and ..; returns their number
+static int read_children(int dir_inode_id, struct entry** children) {
+    int n = 0, cap = READDIR_BATCH_SIZE;
+    *children = malloc(cap * sizeof(struct entry));
+    struct entry batch[READDIR_BATCH_SIZE];
+    struct dir_cursor cursor = DIR_CURSOR_START;
+    while (!dir_cursor_at_end(&cursor)) {
+        int n_read = read_dir_entries(dir_inode_id, &cursor, batch, READDIR_BATCH_SIZE);
+        for (int i = 0; i < n_read; ++i) {
+            if (strcmp(batch[i].filename, ".") == 0 || strcmp(batch[i].filename, "..") == 0
+                || !check_user_id(batch[i].inode_id)) {
+                continue;
+            }
+            if (n == cap) {
+                cap *= 2;
+                *children = realloc(*children, cap * sizeof(struct entry));
+            }
+            (*children)[n++] = batch[i];
+        }
+    }
+    return n;
+}
+
+static long long walk(const struct query* query, int inode_id, const char* path, const char* name,
+                      struct strbuf* out);
+
+// what walking a directory's children adds up to; out gets their lines in order
+static long long walk_children(const struct query* query, const char* path,
+                               const struct entry* children, int n, struct strbuf* out) {
+    long long n_blocks = 0;
+    for (int i = 0; i < n; ++i) {
+        char* child_path = join_path(path, children[i].filename);
+        n_blocks += walk(query, children[i].inode_id, child_path, children[i].filename, out);
+        free(child_path);
+    }
+    return n_blocks;
+}
+
+static int count_blocks(const struct inode* inode) {
+    int n_blocks = 0;
+    for (int i = 0; i < N_DIRECT_PTRS; ++i) {
+        n_blocks += is_correct_block_id(inode->direct[i]);
+    }
+    return n_blocks;
+}
+
+// the lines for a file or a directory before its contents are walked
+static void visit(const struct query* query, const struct inode* inode, const char* path, const char* name,
+                  struct strbuf* out) {
+    if (!query->du && matches(query, inode, name)) {
+        strbuf_appendf(out, "%s\n", path);
+    }
+}
+
+// and after
+static void leave(const struct query* query, const struct inode* inode, const char* path, long long n_blocks,
+                  int top, struct strbuf* out) {
+    if (query->du && (top || (inode->file_type == DIRECTORY && !query->summarize))) {
+        strbuf_appendf(out, "%lld\t%s\n", n_blocks * MINIFS_BLOCK_SIZE / 1024, path);
+    }
+}
+
+// returns the number of blocks of the subtree
+static long long walk(const struct query* query, int inode_id, const char* path, const char* name,
+                      struct strbuf* out) {
+    struct inode inode;
+    read_inode(&inode, inode_id);
+    long long n_blocks = count_blocks(&inode);
+    visit(query, &inode, path, name, out);
+    if (inode.file_type == DIRECTORY) {
+        struct entry* children;
+        int n = read_children(inode_id, &children);
+        n_blocks += walk_children(query, path, children, n, out);
+        free(children);
+    }
+    leave(query, &inode, path, n_blocks, 0, out);
+    return n_blocks;
+}
+
+// the children of the starting directory, shared by the threads walking them
+struct parallel_walk {
+    const struct query* query;
+    const char*         path;
+    const struct entry* children;
+    int                 n_children;
+    _Atomic int         next_child;
+    struct strbuf*      outs;     // one for each child, so that the output comes in the usual order
+    long long*          n_blocks; // same
+};
+
+static void* walk_some_children(void* arg) {
+    struct parallel_walk* pw = arg;
+    user_id = pw->query->user_id;
+    for (int i; (i = atomic_fetch_add(&pw->next_child, 1)) < pw->n_children; ) {
+        pw->n_blocks[i] = walk_children(pw->query, pw->path, pw->children + i, 1, pw->outs + i);
+    }
+    return NULL;
+}
+
+static long long walk_parallel(const struct query* query, const char* path,
+                               const struct entry* children, int n, int n_threads, struct strbuf* out) {
+    struct parallel_walk pw = {
+        .query      = query,
+        .path       = path,
+        .children   = children,
+        .n_children = n,
+        .next_child = 0,
+        .outs       = malloc(n * sizeof(struct strbuf)),
+        .n_blocks   = calloc(n, sizeof(long long))
+    };
+    for (int i = 0; i < n; ++i) {
+        strbuf_init(pw.outs + i);
+    }
+    // the calling thread is one of them
+    pthread_t threads[MAX_QUERY_THREADS];
+    int n_started = 0;
+    while (n_started < n_threads - 1 && n_started < n - 1
+           && pthread_create(threads + n_started, NULL, walk_some_children, &pw) == 0) {
+        ++n_started;
+    }
+    walk_some_children(&pw);
+    for (int i = 0; i < n_started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    long long n_blocks = 0;
+    for (int i = 0; i < n; ++i) {
+        strbuf_append(out, pw.outs[i].data, pw.outs[i].len);
+        strbuf_free(pw.outs + i);
+        n_blocks += pw.n_blocks[i];
+    }
+    free(pw.outs);
+    free(pw.n_blocks);
+    return n_blocks;
+}
+
+static int run_query(const struct query* query, const char* path, int n_threads) {
+    int inode_id = (path == NULL ? work_inode_id : traverse(path));
+    if (!is_allocated_inode_id(inode_id)) {
+        send_failure("invalid path or permission denied\n");
+        return -1;
+    }
+    if (path == NULL) {
+        path = ".";
+    }
+    const char* name = strrchr(path, '/');
+    name = (name == NULL ? path : name + 1);
+
+    struct strbuf* reply = get_reply_buf();
+    struct inode inode;
+    read_inode(&inode, inode_id);
+    long long n_blocks = count_blocks(&inode);
+    visit(query, &inode, path, name, reply);
+    if (inode.file_type == DIRECTORY) {
+        struct entry* children;
+        int n = read_children(inode_id, &children);
+        if (n_threads > 1) {
+            n_blocks += walk_parallel(query, path, children, n, min(n_threads, MAX_QUERY_THREADS), reply);
+        } else {
+            n_blocks += walk_children(query, path, children, n, reply);
+        }
+        free(children);
+    }
+    leave(query, &inode, path, n_blocks, 1, reply);
+
+    send_success();
+    send_nbytes(reply->data, reply->len);
+    return 0;
+}
+
+int disk_usage(const char* path, int summarize, int n_threads) {
+    struct query query = {
+        .du        = 1,
+        .summarize = summarize,
+        .user_id   = user_id
+    };
+    return run_query(&query, path, n_threads);
+}
+
+int find_files(const char* path, const struct find_filter* filter, int n_threads) {
+    struct query query = {
+        .du      = 0,
+        .filter  = filter,
+        .now     = time(NULL),
+        .user_id = user_id
+    };
+    return run_query(&query, path, n_threads);
+}
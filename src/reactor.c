@@ -0,0 +1,258 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "reactor.h"
+#include "worker_pool.h"
+#include "net_io.h"
+#include "lease.h"
+
+#define MAX_EVENTS 256
+
+// event loops only read: they collect whole requests without blocking and hand each one to a worker,
+// so a client can have many requests in flight and their responses go out as they complete.
+// a request that has to run alone stops the reading (the connection stays disarmed, see EPOLLONESHOT)
+// until it's done; the socket itself stays blocking for the workers, the loops read with MSG_DONTWAIT
+static int* epoll_fds;
+static int n_loops;
+static _Atomic unsigned next_loop;
+static void (*handler)(struct request* request);
+
+static void arm(struct conn* conn, int op) {
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT,
+        .data.ptr = conn
+    };
+    epoll_ctl(conn->epoll_fd, op, conn->fd, &event);
+}
+
+static void free_request(struct request* request) {
+    if (request != NULL) {
+        free(request->payload);
+        free(request);
+    }
+}
+
+static void close_conn(struct conn* conn) {
+    // closing alone doesn't do it if the socket was duplicated, as for shared-memory sessions
+    epoll_ctl(conn->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    drop_leases(conn);
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->mutex);
+    pthread_mutex_destroy(&conn->send_mutex);
+    free_request(conn->waiting);
+    free_request(conn->in_request);
+    free(conn);
+}
+
+// requests that change the session or read more from the socket see no other request of theirs running,
+// and so do writes, unless the client vouched for them with REQUEST_UNORDERED;
+// reads may run in any order with each other
+static int must_run_alone(const struct request* request) {
+    if (request->conn->state == CONN_LOGIN) {
+        return 1;
+    }
+    switch (request->header.opcode) {
+        case OP_HELP:
+        case OP_PWD:
+        case OP_LS:
+        case OP_READDIR:
+        case OP_DOWNLOAD:
+        case OP_CAT:
+        case OP_READ:
+        case OP_DU:
+        case OP_FIND:
+        case OP_STAT:
+        case OP_OPEN_UPLOAD:
+        case OP_OPEN_DOWNLOAD:
+        case OP_OPEN_PARALLEL_UPLOAD:
+        case OP_OPEN_PARALLEL_DOWNLOAD:
+            return 0;
+        case OP_LOGIN:
+        case OP_EXIT:
+        case OP_CD:
+        case OP_UPLOAD:
+        case OP_WRITE:
+            return 1;
+        default:
+            return !(request->header.flags & REQUEST_UNORDERED);
+    }
+}
+
+static void run_request(struct request* request, int alone) {
+    struct conn* conn = request->conn;
+    client_fd     = conn->fd;
+    user_id       = conn->user_id;
+    work_inode_id = conn->work_inode_id;
+    nested        = 0;
+
+    set_current_request(&request->header, &conn->send_mutex);
+    handler(request);
+    if (flush_reply() == -1) {
+        // the event loop sees the connection end and hangs up
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    if (alone) {
+        conn->user_id       = user_id;
+        conn->work_inode_id = work_inode_id;
+    }
+}
+
+static void serve_request(void* job) {
+    struct request* request = job;
+    struct conn* conn = request->conn;
+    while (request != NULL) {
+        int alone = must_run_alone(request);
+        run_request(request, alone);
+        free_request(request);
+
+        pthread_mutex_lock(&conn->mutex);
+        request = NULL;
+        --conn->n_running;
+        if (conn->state == CONN_CLOSING) {
+            int last = (conn->n_running == 0);
+            pthread_mutex_unlock(&conn->mutex);
+            if (last) {
+                close_conn(conn);
+            }
+            return;
+        }
+        if (conn->waiting != NULL && conn->n_running == 0) {
+            // run it right here: handing it to the queue could block a worker on a full queue
+            request = conn->waiting;
+            conn->waiting = NULL;
+            ++conn->n_running;
+        } else if (alone) {
+            // reading was stopped for this one
+            arm(conn, EPOLL_CTL_MOD);
+        }
+        pthread_mutex_unlock(&conn->mutex);
+    }
+}
+
+// called with the whole request received; returns 0 if reading should stop
+static int dispatch(struct conn* conn, struct request* request) {
+    pthread_mutex_lock(&conn->mutex);
+    if (!must_run_alone(request)) {
+        ++conn->n_running;
+        pthread_mutex_unlock(&conn->mutex);
+        submit_job(request);
+        return 1;
+    }
+    if (conn->n_running > 0) {
+        // the last running request picks it up
+        conn->waiting = request;
+        pthread_mutex_unlock(&conn->mutex);
+        return 0;
+    }
+    ++conn->n_running;
+    pthread_mutex_unlock(&conn->mutex);
+    submit_job(request);
+    return 0;
+}
+
+static void hang_up(struct conn* conn) {
+    pthread_mutex_lock(&conn->mutex);
+    conn->state = CONN_CLOSING;
+    int idle = (conn->n_running == 0);
+    pthread_mutex_unlock(&conn->mutex);
+    if (idle) {
+        close_conn(conn);
+    }
+}
+
+// read requests until the socket runs dry or one of them has to run alone;
+// nothing after that one is read, it may be data meant for the worker
+static void on_readable(struct conn* conn) {
+    while (1) {
+        if (conn->in_request == NULL) {
+            conn->in_request = calloc(1, sizeof(struct request));
+            conn->in_request->conn = conn;
+        }
+        struct request* request = conn->in_request;
+        char* dest;
+        int n_wanted;
+        if (conn->in_len < MSG_HEADER_SIZE) {
+            dest = (char*)conn->in_header + conn->in_len;
+            n_wanted = MSG_HEADER_SIZE - conn->in_len;
+        } else {
+            dest = request->payload + (conn->in_len - MSG_HEADER_SIZE);
+            n_wanted = request->header.payload_len - (conn->in_len - MSG_HEADER_SIZE);
+        }
+        if (n_wanted > 0) {
+            ssize_t n = recv(conn->fd, dest, n_wanted, MSG_DONTWAIT);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                arm(conn, EPOLL_CTL_MOD);
+                return;
+            }
+            if (n <= 0) {
+                hang_up(conn);
+                return;
+            }
+            conn->in_len += n;
+            if (conn->in_len == MSG_HEADER_SIZE) {
+                decode_header(conn->in_header, &request->header);
+                if (request->header.payload_len > max_request_payload(request->header.opcode)) {
+                    // can't be a request we understand, and there's no way to resync
+                    hang_up(conn);
+                    return;
+                }
+                request->payload = malloc(request->header.payload_len + 1);
+            }
+            continue;
+        }
+        // the whole request is here
+        request->payload[request->header.payload_len] = '\0';
+        conn->in_request = NULL;
+        conn->in_len = 0;
+        if (!dispatch(conn, request)) {
+            return;
+        }
+    }
+}
+
+static void* event_loop(void* arg) {
+    int epoll_fd = *(int*)arg;
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        for (int i = 0; i < n; ++i) {
+            on_readable(events[i].data.ptr);
+        }
+    }
+    return NULL;
+}
+
+void start_reactor(int n_event_loops, int n_workers, int queue_capacity,
+                   void (*handle_request)(struct request* request)) {
+    handler = handle_request;
+    start_worker_pool(n_workers, queue_capacity, serve_request);
+    n_loops = n_event_loops;
+    epoll_fds = malloc(n_loops * sizeof(int));
+    for (int i = 0; i < n_loops; ++i) {
+        epoll_fds[i] = epoll_create1(0);
+        pthread_t thread;
+        pthread_create(&thread, NULL, event_loop, epoll_fds + i);
+        pthread_detach(thread);
+    }
+}
+
+void reactor_add_connection(int fd) {
+    struct conn* conn = calloc(1, sizeof(struct conn));
+    conn->fd            = fd;
+    conn->epoll_fd      = epoll_fds[atomic_fetch_add(&next_loop, 1) % n_loops];
+    conn->state         = CONN_LOGIN;
+    conn->work_inode_id = ROOT_INODE_ID;
+    pthread_mutex_init(&conn->mutex, NULL);
+    pthread_mutex_init(&conn->send_mutex, NULL);
+    arm(conn, EPOLL_CTL_ADD);
+}
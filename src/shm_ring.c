@@ -0,0 +1,169 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "shm_ring.h"
+
+// times to look at the ring again before going to sleep; the other side usually answers sooner
+// than a trip through the scheduler would take
+#define SHM_SPIN_ITERATIONS 1000
+
+int shm_create(int fds[SHM_N_FDS]) {
+    fds[SHM_MEM_FD] = memfd_create("minifs-shm", MFD_CLOEXEC);
+    if (fds[SHM_MEM_FD] == -1) {
+        return -1;
+    }
+    if (ftruncate(fds[SHM_MEM_FD], sizeof(struct shm_area)) == -1) {
+        close(fds[SHM_MEM_FD]);
+        return -1;
+    }
+    fds[SHM_SERVER_EVENT_FD] = eventfd(0, EFD_CLOEXEC);
+    fds[SHM_CLIENT_EVENT_FD] = eventfd(0, EFD_CLOEXEC);
+    if (fds[SHM_SERVER_EVENT_FD] == -1 || fds[SHM_CLIENT_EVENT_FD] == -1) {
+        for (int i = 0; i < SHM_N_FDS; ++i) {
+            if (fds[i] != -1) {
+                close(fds[i]);
+            }
+        }
+        return -1;
+    }
+    return 0;
+}
+
+int shm_attach(struct shm_channel* channel, const int fds[SHM_N_FDS], int server_side, int hangup_fd) {
+    // a fresh memfd is all zeroes, which is an empty area
+    void* area = mmap(NULL, sizeof(struct shm_area), PROT_READ | PROT_WRITE, MAP_SHARED, fds[SHM_MEM_FD], 0);
+    if (area == MAP_FAILED) {
+        return -1;
+    }
+    channel->area      = area;
+    channel->hangup_fd = hangup_fd;
+    if (server_side) {
+        channel->tx            = &channel->area->responses;
+        channel->rx            = &channel->area->requests;
+        channel->sleeping      = &channel->area->server_sleeping;
+        channel->peer_sleeping = &channel->area->client_sleeping;
+        channel->event_fd      = fds[SHM_SERVER_EVENT_FD];
+        channel->peer_event_fd = fds[SHM_CLIENT_EVENT_FD];
+    } else {
+        channel->tx            = &channel->area->requests;
+        channel->rx            = &channel->area->responses;
+        channel->sleeping      = &channel->area->client_sleeping;
+        channel->peer_sleeping = &channel->area->server_sleeping;
+        channel->event_fd      = fds[SHM_CLIENT_EVENT_FD];
+        channel->peer_event_fd = fds[SHM_SERVER_EVENT_FD];
+    }
+    return 0;
+}
+
+void shm_detach(struct shm_channel* channel) {
+    munmap(channel->area, sizeof(struct shm_area));
+    close(channel->event_fd);
+    close(channel->peer_event_fd);
+    if (channel->hangup_fd != -1) {
+        close(channel->hangup_fd);
+    }
+}
+
+static size_t bytes_used(struct shm_ring* ring) {
+    return atomic_load(&ring->head) - atomic_load(&ring->tail);
+}
+
+// tx has room to write / rx has something to read
+static int can_go_on(struct shm_channel* channel, int sending) {
+    return (sending ? bytes_used(channel->tx) < SHM_RING_SIZE : bytes_used(channel->rx) > 0);
+}
+
+// the flag is set before the last look at the ring and the other side publishes before looking at the flag
+// (both sequentially consistent), so either it sees the flag or this sees its update
+static void wake_peer(struct shm_channel* channel) {
+    if (atomic_load(channel->peer_sleeping)) {
+        uint64_t one = 1;
+        while (write(channel->peer_event_fd, &one, sizeof(one)) == -1 && errno == EINTR) {
+        }
+    }
+}
+
+static int wait_for_peer(struct shm_channel* channel, int sending) {
+    for (int i = 0; i < SHM_SPIN_ITERATIONS; ++i) {
+        if (can_go_on(channel, sending)) {
+            return 0;
+        }
+    }
+    atomic_store(channel->sleeping, 1);
+    int result = 0;
+    while (!can_go_on(channel, sending)) {
+        struct pollfd fds[2] = {
+            { .fd = channel->event_fd,  .events = POLLIN },
+            { .fd = channel->hangup_fd, .events = POLLIN }
+        };
+        if (poll(fds, (channel->hangup_fd == -1 ? 1 : 2), -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            result = -1;
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            uint64_t count;
+            read(channel->event_fd, &count, sizeof(count));
+        } else if (channel->hangup_fd != -1 && fds[1].revents != 0) {
+            // nothing is expected on the socket anymore, so anything there means it's closing
+            result = -1;
+            break;
+        }
+    }
+    atomic_store(channel->sleeping, 0);
+    return result;
+}
+
+int shm_send(struct shm_channel* channel, const void* buf, size_t n) {
+    struct shm_ring* ring = channel->tx;
+    const char* ptr = buf;
+    while (n > 0) {
+        if (wait_for_peer(channel, 1) == -1) {
+            return -1;
+        }
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        size_t space = SHM_RING_SIZE - bytes_used(ring);
+        size_t pos = head & (SHM_RING_SIZE - 1);
+        size_t n_cur = (n < space ? n : space);
+        if (n_cur > SHM_RING_SIZE - pos) {
+            n_cur = SHM_RING_SIZE - pos; // the rest goes to the start on the next round
+        }
+        memcpy(ring->data + pos, ptr, n_cur);
+        atomic_store(&ring->head, head + n_cur);
+        wake_peer(channel);
+        ptr += n_cur;
+        n -= n_cur;
+    }
+    return 0;
+}
+
+int shm_recv(struct shm_channel* channel, void* buf, size_t n) {
+    struct shm_ring* ring = channel->rx;
+    char* ptr = buf;
+    while (n > 0) {
+        if (wait_for_peer(channel, 0) == -1) {
+            return -1;
+        }
+        uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t used = bytes_used(ring);
+        size_t pos = tail & (SHM_RING_SIZE - 1);
+        size_t n_cur = (n < used ? n : used);
+        if (n_cur > SHM_RING_SIZE - pos) {
+            n_cur = SHM_RING_SIZE - pos;
+        }
+        memcpy(ptr, ring->data + pos, n_cur);
+        atomic_store(&ring->tail, tail + n_cur);
+        wake_peer(channel);
+        ptr += n_cur;
+        n -= n_cur;
+    }
+    return 0;
+}
@@ -0,0 +1,122 @@
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "shm_session.h"
+#include "globals.h"
+#include "net_io.h"
+#include "protocol.h"
+#include "shm_ring.h"
+#include "lease.h"
+
+struct shm_session {
+    struct shm_channel channel;
+    struct conn        conn; // the session's state, as a connection of the reactor would have it
+    void (*handler)(struct request* request);
+};
+
+static void close_session(struct shm_session* session) {
+    shm_detach(&session->channel);
+    drop_leases(&session->conn);
+    pthread_mutex_destroy(&session->conn.mutex);
+    pthread_mutex_destroy(&session->conn.send_mutex);
+    free(session);
+}
+
+// reads the next request off the channel, -1 if there's none to be had
+static int recv_request(struct shm_session* session, struct request* request) {
+    unsigned char header[MSG_HEADER_SIZE];
+    if (shm_recv(&session->channel, header, sizeof(header)) == -1) {
+        return -1;
+    }
+    request->conn = &session->conn;
+    decode_header(header, &request->header);
+    if (request->header.payload_len > max_request_payload(request->header.opcode)) {
+        // can't be a request we understand, and there's no way to resync
+        return -1;
+    }
+    request->payload = malloc(request->header.payload_len + 1);
+    if (shm_recv(&session->channel, request->payload, request->header.payload_len) == -1) {
+        free(request->payload);
+        return -1;
+    }
+    request->payload[request->header.payload_len] = '\0';
+    return 0;
+}
+
+static void* serve_session(void* arg) {
+    struct shm_session* session = arg;
+    struct conn* conn = &session->conn;
+    client_fd = -1;
+    set_shm_channel(&session->channel);
+
+    struct request request;
+    while (conn->state != CONN_CLOSING && recv_request(session, &request) == 0) {
+        user_id       = conn->user_id;
+        work_inode_id = conn->work_inode_id;
+        nested        = 0;
+        set_current_request(&request.header, &conn->send_mutex);
+        session->handler(&request);
+        int broken = (flush_reply() == -1);
+        conn->user_id       = user_id;
+        conn->work_inode_id = work_inode_id;
+        free(request.payload);
+        if (broken) {
+            break;
+        }
+    }
+    set_shm_channel(NULL);
+    close_session(session);
+    return NULL;
+}
+
+int open_shm_session(struct conn* conn, void (*handle_request)(struct request* request)) {
+    // the fds can only be passed over a local socket
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(conn->fd, (struct sockaddr*)&addr, &addr_len) == -1 || addr.ss_family != AF_UNIX) {
+        send_failure("shared memory is only offered on the local socket\n");
+        return -1;
+    }
+    int fds[SHM_N_FDS];
+    if (shm_create(fds) == -1) {
+        send_failure("couldn't set up shared memory\n");
+        return -1;
+    }
+    struct shm_session* session = calloc(1, sizeof(struct shm_session));
+    int hangup_fd = dup(conn->fd);
+    if (hangup_fd == -1 || shm_attach(&session->channel, fds, 1, hangup_fd) == -1) {
+        for (int i = 0; i < SHM_N_FDS; ++i) {
+            close(fds[i]);
+        }
+        if (hangup_fd != -1) {
+            close(hangup_fd);
+        }
+        free(session);
+        send_failure("couldn't set up shared memory\n");
+        return -1;
+    }
+    session->handler            = handle_request;
+    session->conn.fd            = -1;
+    session->conn.epoll_fd      = -1;
+    session->conn.state         = CONN_OPEN;
+    session->conn.user_id       = user_id;
+    session->conn.work_inode_id = work_inode_id;
+    pthread_mutex_init(&session->conn.mutex, NULL);
+    pthread_mutex_init(&session->conn.send_mutex, NULL);
+
+    send_success();
+    int result = flush_reply_with_fds(fds, SHM_N_FDS);
+    close(fds[SHM_MEM_FD]);
+    if (result == -1) {
+        close_session(session);
+        return -1;
+    }
+    conn->state = CONN_CLOSING;
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, serve_session, session);
+    pthread_detach(thread);
+    return 0;
+}
@@ -1,3 +1,5 @@
+#include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -43,3 +45,50 @@ void reverse_str(char* str) {
         str[r] = c;
     }
 }
+
+void strbuf_init(struct strbuf* sb) {
+    sb->data = NULL;
+    sb->len  = 0;
+    sb->cap  = 0;
+}
+
+void strbuf_free(struct strbuf* sb) {
+    free(sb->data);
+    strbuf_init(sb);
+}
+
+void strbuf_reset(struct strbuf* sb) {
+    sb->len = 0;
+    if (sb->data != NULL) {
+        sb->data[0] = '\0';
+    }
+}
+
+void strbuf_append(struct strbuf* sb, const void* data, size_t n) {
+    if (sb->len + n + 1 > sb->cap) {
+        size_t new_cap = (sb->cap == 0 ? 256 : sb->cap);
+        while (sb->len + n + 1 > new_cap) {
+            new_cap *= 2;
+        }
+        sb->data = realloc(sb->data, new_cap);
+        sb->cap  = new_cap;
+    }
+    memcpy(sb->data + sb->len, data, n);
+    sb->len += n;
+    sb->data[sb->len] = '\0';
+}
+
+void strbuf_appendf(struct strbuf* sb, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    if (n <= 0) {
+        return;
+    }
+    char tmp[n + 1];
+    va_start(args, fmt);
+    vsnprintf(tmp, n + 1, fmt, args);
+    va_end(args);
+    strbuf_append(sb, tmp, n);
+}
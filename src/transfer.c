@@ -0,0 +1,91 @@
+#include <sys/random.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "transfer.h"
+
+static struct {
+    int             in_use;
+    uint32_t        id;
+    uint64_t        secret;
+    time_t          opened;
+    struct transfer transfer;
+} pending[MAX_PENDING_TRANSFERS];
+
+static uint32_t last_id;
+static pthread_mutex_t pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int is_expired(int slot, time_t now) {
+    return now - pending[slot].opened > TRANSFER_TIMEOUT;
+}
+
+// frees the slots of expired tickets so that whatever they hold on to is let go of in time
+static void sweep_expired(time_t now) {
+    for (int slot = 0; slot < MAX_PENDING_TRANSFERS; ++slot) {
+        if (pending[slot].in_use && is_expired(slot, now)) {
+            pending[slot].in_use = 0;
+            if (pending[slot].transfer.abandon != NULL) {
+                pending[slot].transfer.abandon(&pending[slot].transfer);
+            }
+        }
+    }
+}
+
+int open_transfer(const struct transfer* transfer, char ticket[TICKET_LEN]) {
+    // the id only finds the slot, the secret is what proves the data connection belongs to the session
+    uint64_t secret;
+    if (getrandom(&secret, sizeof(secret), 0) != sizeof(secret)) {
+        return -1;
+    }
+    time_t now = time(NULL);
+    pthread_mutex_lock(&pending_mutex);
+    sweep_expired(now);
+    for (int slot = 0; slot < MAX_PENDING_TRANSFERS; ++slot) {
+        if (pending[slot].in_use) {
+            continue;
+        }
+        pending[slot].in_use   = 1;
+        pending[slot].id       = ++last_id;
+        pending[slot].secret   = secret;
+        pending[slot].opened   = now;
+        pending[slot].transfer = *transfer;
+        snprintf(ticket, TICKET_LEN, "%u %016llx", pending[slot].id, (unsigned long long)secret);
+        pthread_mutex_unlock(&pending_mutex);
+        return 0;
+    }
+    pthread_mutex_unlock(&pending_mutex);
+    return -1;
+}
+
+void expire_transfers() {
+    pthread_mutex_lock(&pending_mutex);
+    sweep_expired(time(NULL));
+    pthread_mutex_unlock(&pending_mutex);
+}
+
+int claim_transfer(const char* ticket, struct transfer* transfer) {
+    uint32_t id;
+    unsigned long long secret;
+    if (sscanf(ticket, "%u %llx", &id, &secret) != 2) {
+        return -1;
+    }
+    time_t now = time(NULL);
+    int result = -1;
+    pthread_mutex_lock(&pending_mutex);
+    sweep_expired(now);
+    for (int slot = 0; slot < MAX_PENDING_TRANSFERS; ++slot) {
+        if (!pending[slot].in_use || pending[slot].id != id) {
+            continue;
+        }
+        if (pending[slot].secret == secret) {
+            *transfer = pending[slot].transfer;
+            pending[slot].in_use = 0;
+            result = 0;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&pending_mutex);
+    return result;
+}
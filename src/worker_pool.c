@@ -0,0 +1,68 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "worker_pool.h"
+
+// ring buffer of jobs waiting for a worker
+static struct {
+    void**          jobs;
+    int             capacity;
+    int             head;
+    int             size;
+    pthread_mutex_t mutex;
+    pthread_cond_t  not_empty;
+    pthread_cond_t  not_full;
+} queue = {
+    .mutex     = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full  = PTHREAD_COND_INITIALIZER
+};
+
+static void (*handler)(void* job);
+
+static void* take_job() {
+    pthread_mutex_lock(&queue.mutex);
+    while (queue.size == 0) {
+        pthread_cond_wait(&queue.not_empty, &queue.mutex);
+    }
+    void* job = queue.jobs[queue.head];
+    queue.head = (queue.head + 1) % queue.capacity;
+    --queue.size;
+    pthread_cond_signal(&queue.not_full);
+    pthread_mutex_unlock(&queue.mutex);
+    return job;
+}
+
+static void* worker_loop(void* arg) {
+    (void)arg;
+    while (1) {
+        handler(take_job());
+    }
+    return NULL;
+}
+
+void start_worker_pool(int n_workers, int queue_capacity, void (*handle_job)(void* job)) {
+    handler = handle_job;
+    queue.jobs = malloc(queue_capacity * sizeof(void*));
+    queue.capacity = queue_capacity;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int i = 0; i < n_workers; ++i) {
+        pthread_t thread;
+        pthread_create(&thread, &attr, worker_loop, NULL);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+void submit_job(void* job) {
+    pthread_mutex_lock(&queue.mutex);
+    while (queue.size == queue.capacity) {
+        pthread_cond_wait(&queue.not_full, &queue.mutex);
+    }
+    queue.jobs[(queue.head + queue.size) % queue.capacity] = job;
+    ++queue.size;
+    pthread_cond_signal(&queue.not_empty);
+    pthread_mutex_unlock(&queue.mutex);
+}
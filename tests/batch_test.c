@@ -0,0 +1,265 @@
+// atomic batches: a failing line undoes the ones before it, and only the end result is published
+// usage: batch_test (creates and removes a disk image in the working directory)
+
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "globals.h"
+#include "block.h"
+#include "inode.h"
+#include "interface.h"
+#include "disk_io.h"
+#include "meta_cache.h"
+#include "net_io.h"
+#include "protocol.h"
+#include "batch.h"
+
+int disk_fd;
+_Thread_local int nested;
+_Thread_local int client_fd;
+_Thread_local int work_inode_id;
+_Thread_local int user_id;
+
+#define DISK_PATH "batch_test.img"
+#define N_REPEATED 30
+#define N_ROUNDS   10
+
+static int n_failed;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            ++n_failed; \
+        } \
+    } while (0)
+
+// an empty file system with just the root directory, as the server makes it
+static void create_disk() {
+    disk_fd = open(DISK_PATH, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (disk_fd == -1) {
+        perror(DISK_PATH);
+        exit(1);
+    }
+    char buf[MINIFS_BLOCK_SIZE];
+    memset(buf, -1, sizeof(buf));
+    for (int i = 0; i * MINIFS_BLOCK_SIZE < DISK_SIZE; ++i) {
+        write_data(buf, MINIFS_BLOCK_SIZE, MINIFS_BLOCK_SIZE * i);
+    }
+    struct superblock sb = {
+        .magic         = MAGIC,
+        .n_free_blocks = N_BLOCKS,
+        .n_free_inodes = N_INODES
+    };
+    write_superblock(&sb);
+    init_block_allocator();
+    init_inode_allocator();
+
+    struct inode root;
+    root.file_type     = DIRECTORY;
+    root.ref_count     = 1;
+    root.created       =
+    root.last_accessed =
+    root.last_modified = time(NULL);
+    root.user_id       = 0;
+    memset(root.direct, -1, sizeof(root.direct));
+    allocate_inode_near(ROOT_INODE_ID);
+    init_dir(&root, ROOT_INODE_ID, ROOT_INODE_ID);
+    write_inode(&root, ROOT_INODE_ID);
+    meta_cache_init();
+}
+
+// runs the batch and reads back its reply, whose status is returned; results gets a byte per line
+static int batch(int peer_fd, const char* lines, int atomic, unsigned char* results, int n_lines) {
+    static pthread_mutex_t send_mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct msg_header request = { .opcode = OP_BATCH, .flags = (atomic ? REQUEST_ATOMIC : 0), .request_id = 1 };
+    set_current_request(&request, &send_mutex);
+    char* copy = strdup(lines);
+    run_batch(copy, atomic);
+    free(copy);
+    flush_reply();
+
+    unsigned char header_buf[MSG_HEADER_SIZE];
+    struct msg_header reply;
+    if (recv(peer_fd, header_buf, sizeof(header_buf), MSG_WAITALL) != sizeof(header_buf)) {
+        return -1;
+    }
+    decode_header(header_buf, &reply);
+    if (reply.payload_len != (uint32_t)n_lines
+        || recv(peer_fd, results, n_lines, MSG_WAITALL) != n_lines) {
+        return -1;
+    }
+    return reply.status;
+}
+
+struct lookup {
+    const char* path;
+    int         inode_id;
+    int         is_regular_file;
+    int         n_entries;
+};
+
+static void* run_lookup(void* arg) {
+    struct lookup* lookup = arg;
+    user_id       = 1;
+    work_inode_id = ROOT_INODE_ID;
+    lookup->inode_id = traverse(lookup->path);
+    lookup->is_regular_file = is_regular_file(lookup->inode_id);
+    struct dir_cursor cursor = DIR_CURSOR_START;
+    struct entry entries[ENTRIES_PER_BLOCK];
+    lookup->n_entries = (is_dir(lookup->inode_id)
+                         ? read_dir_entries(lookup->inode_id, &cursor, entries, ENTRIES_PER_BLOCK) : -1);
+    return NULL;
+}
+
+// from another thread, like a reader on another connection would see it
+static struct lookup look_up(const char* path) {
+    struct lookup lookup = { .path = path };
+    pthread_t thread;
+    pthread_create(&thread, NULL, run_lookup, &lookup);
+    pthread_join(thread, NULL);
+    return lookup;
+}
+
+// a reader on another thread that keeps looking while batches run; each look made entirely during a batch
+// has to find the tree as it was before it
+struct watcher {
+    pthread_t  thread;
+    int        (*is_before)();
+    atomic_int running; // while a batch runs
+    atomic_int stop;
+    int        n_looks;
+    int        n_changed;
+};
+
+static void* watch(void* arg) {
+    struct watcher* watcher = arg;
+    user_id       = 1;
+    work_inode_id = ROOT_INODE_ID;
+    while (!atomic_load(&watcher->stop)) {
+        int started = atomic_load(&watcher->running);
+        int is_before = watcher->is_before();
+        if (started && atomic_load(&watcher->running)) {
+            ++watcher->n_looks;
+            watcher->n_changed += !is_before;
+        }
+    }
+    return NULL;
+}
+
+static void start_watching(struct watcher* watcher, int (*is_before)()) {
+    memset(watcher, 0, sizeof(struct watcher));
+    watcher->is_before = is_before;
+    pthread_create(&watcher->thread, NULL, watch, watcher);
+}
+
+static void stop_watching(struct watcher* watcher) {
+    atomic_store(&watcher->stop, 1);
+    pthread_join(watcher->thread, NULL);
+}
+
+// first, then repeated N_REPEATED times (formatted with its index), then last: long enough for the watcher
+// to look a number of times while it runs
+static int watched_batch(struct watcher* watcher, int peer_fd, const char* first, const char* repeated,
+                         const char* last, int atomic, unsigned char* results) {
+    char lines[4096];
+    strcpy(lines, first);
+    for (int i = 0; i < N_REPEATED; ++i) {
+        sprintf(lines + strlen(lines), repeated, i);
+    }
+    strcat(lines, last);
+    int n_lines = 0;
+    for (const char* c = lines; *c != '\0'; ++c) {
+        n_lines += (*c == '\n');
+    }
+    atomic_store(&watcher->running, 1);
+    int status = batch(peer_fd, lines, atomic, results, n_lines);
+    atomic_store(&watcher->running, 0);
+    return status;
+}
+
+static int is_before_undone() {
+    return traverse("/c") == -1 && is_regular_file(traverse("/b/g")) && is_dir(traverse("/a"));
+}
+
+static int is_before_removal() {
+    return is_regular_file(traverse("/b/g")) && is_regular_file(traverse("/b/x0"));
+}
+
+int main() {
+    create_disk();
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    client_fd     = fds[0];
+    user_id       = 1;
+    work_inode_id = ROOT_INODE_ID;
+
+    unsigned char results[3];
+    CHECK(batch(fds[1], "mkdir /a\ntouch /a/f\n", 1, results, 2) == STATUS_OK);
+    CHECK(results[0] == BATCH_OK && results[1] == BATCH_OK);
+
+    // the create and the move go through, then the last line fails
+    CHECK(batch(fds[1], "mkdir /b\nmv /a/f /b/g\ntouch /missing/x\n", 1, results, 3) == STATUS_ERROR);
+    CHECK(results[0] == BATCH_UNDONE && results[1] == BATCH_UNDONE && results[2] == BATCH_FAILED);
+    CHECK(look_up("/b").inode_id == -1);
+    CHECK(look_up("/b/g").inode_id == -1);
+    CHECK(look_up("/a/f").is_regular_file);
+    CHECK(look_up("/").n_entries == 3); // ".", ".." and "a"
+    CHECK(look_up("/a").n_entries == 3);
+    CHECK(get_n_free_inodes() == N_INODES - 3);
+
+    CHECK(batch(fds[1], "mkdir /b\nmv /a/f /b/g\n", 1, results, 2) == STATUS_OK);
+    CHECK(results[0] == BATCH_OK && results[1] == BATCH_OK);
+    CHECK(look_up("/b/g").is_regular_file);
+    CHECK(look_up("/a/f").inode_id == -1);
+    CHECK(look_up("/").n_entries == 4);
+
+    unsigned char many_results[N_REPEATED + 4];
+    struct watcher watcher;
+    int n_looks = 0;
+
+    // the lines that went through before the failing one are never seen, neither while they run nor after
+    start_watching(&watcher, is_before_undone);
+    for (int round = 0; round < N_ROUNDS; ++round) {
+        CHECK(watched_batch(&watcher, fds[1], "mkdir /c\nmv /b/g /c/g\nrm /a\n", "touch /c/f%d\n",
+                            "touch /missing/x\n", 1, many_results) == STATUS_ERROR);
+    }
+    stop_watching(&watcher);
+    CHECK(watcher.n_changed == 0);
+    n_looks += watcher.n_looks;
+    CHECK(look_up("/").n_entries == 4);
+
+    // a removed inode is freed right away, but it stays allocated for the readers until the batch ends
+    struct watcher unwatched = { 0 };
+    CHECK(watched_batch(&unwatched, fds[1], "", "touch /b/x%d\n", "", 0, many_results) == STATUS_OK);
+    start_watching(&watcher, is_before_removal);
+    for (int round = 0; round < N_ROUNDS; ++round) {
+        CHECK(watched_batch(&watcher, fds[1], "rm /b/g\n", "rm /b/x%d\n", "", 0, many_results) == STATUS_OK);
+        CHECK(watched_batch(&unwatched, fds[1], "touch /b/g\n", "touch /b/x%d\n", "", 0,
+                            many_results) == STATUS_OK);
+    }
+    stop_watching(&watcher);
+    CHECK(watcher.n_changed == 0);
+    n_looks += watcher.n_looks;
+    CHECK(look_up("/b/x0").is_regular_file);
+    CHECK(look_up("/b/g").is_regular_file);
+    // the readers have to have had a chance, or the checks above say nothing
+    CHECK(n_looks > 0);
+
+    close(fds[0]);
+    close(fds[1]);
+    close(disk_fd);
+    unlink(DISK_PATH);
+    if (n_failed > 0) {
+        fprintf(stderr, "%d checks failed\n", n_failed);
+        return 1;
+    }
+    puts("ok");
+    return 0;
+}